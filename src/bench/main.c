@@ -0,0 +1,457 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#if !defined _WIN32
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <clog/clog.h>
+#include <clog/console.h>
+#include <flood/out_stream.h>
+#include <imprint/linear_allocator.h>
+#include <nimble-steps/fan_out.h>
+#include <nimble-steps/receive_mask.h>
+#include <nimble-steps/redundant_steps.h>
+#include <nimble-steps/steps.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+clog_config g_clog;
+
+char g_clog_temp_str[CLOG_TEMP_STR_SIZE];
+
+// Each sample times a batch of operations, since a single operation is close to the timer resolution
+#define BENCH_BATCH_SIZE (16)
+#define BENCH_MAX_SAMPLE_COUNT (100000)
+#define BENCH_MAX_PAYLOAD_OCTET_COUNT (512)
+#define BENCH_SUBSCRIBER_COUNT (1024)
+#define BENCH_DATAGRAM_OCTET_COUNT (1200)
+
+typedef struct BenchResult {
+    const char* name;
+    size_t fillCount;
+    size_t payloadOctetCount;
+    size_t operationsPerSample;
+    size_t sampleCount;
+    double nanosecondsPerOperation[BENCH_MAX_SAMPLE_COUNT];
+} BenchResult;
+
+static BenchResult benchResult;
+static uint8_t benchMemory[1024 * 1024];
+static uint8_t benchFanOutMemory[256 * 1024];
+static NimbleStepsReceiveMaskBits benchAckMasks[BENCH_SUBSCRIBER_COUNT];
+static uint8_t benchPayload[BENCH_MAX_PAYLOAD_OCTET_COUNT];
+static size_t benchSampleCount = 20000;
+
+static uint64_t benchNanoseconds(void)
+{
+#if defined _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) ((double) counter.QuadPart * 1000000000.0 / (double) frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#endif
+}
+
+static void benchBegin(const char* name, size_t fillCount, size_t payloadOctetCount, size_t operationsPerSample)
+{
+    benchResult.name = name;
+    benchResult.fillCount = fillCount;
+    benchResult.payloadOctetCount = payloadOctetCount;
+    benchResult.operationsPerSample = operationsPerSample;
+    benchResult.sampleCount = 0;
+}
+
+static void benchAddSample(uint64_t before, uint64_t after)
+{
+    if (benchResult.sampleCount == BENCH_MAX_SAMPLE_COUNT) {
+        return;
+    }
+    benchResult.nanosecondsPerOperation[benchResult.sampleCount++] = (double) (after - before) /
+                                                                      (double) benchResult.operationsPerSample;
+}
+
+static int benchCompareDouble(const void* a, const void* b)
+{
+    double first = *(const double*) a;
+    double second = *(const double*) b;
+
+    return (first > second) - (first < second);
+}
+
+static double benchPercentile(const double* sorted, size_t count, double percentile)
+{
+    size_t index = (size_t) (percentile * (double) (count - 1) + 0.5);
+    return sorted[index];
+}
+
+/// Writes one JSON object per line, so the output can be collected and compared between runs
+static void benchEnd(void)
+{
+    double* samples = benchResult.nanosecondsPerOperation;
+    size_t count = benchResult.sampleCount;
+    if (count == 0) {
+        return;
+    }
+
+    qsort(samples, count, sizeof(samples[0]), benchCompareDouble);
+
+    double sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += samples[i];
+    }
+    double mean = sum / (double) count;
+
+    printf("{\"benchmark\":\"%s\",\"fill\":%zu,\"payload\":%zu,\"samples\":%zu,\"opsPerSample\":%zu,"
+           "\"meanNs\":%.2f,\"p50Ns\":%.2f,\"p90Ns\":%.2f,\"p99Ns\":%.2f,\"maxNs\":%.2f,\"opsPerSecond\":%.0f}\n",
+           benchResult.name, benchResult.fillCount, benchResult.payloadOctetCount, count,
+           benchResult.operationsPerSample, mean, benchPercentile(samples, count, 0.50),
+           benchPercentile(samples, count, 0.90), benchPercentile(samples, count, 0.99), samples[count - 1],
+           mean > 0 ? 1000000000.0 / mean : 0.0);
+}
+
+static void benchInitSteps(NbsSteps* steps, StepId startId)
+{
+    ImprintLinearAllocator allocator;
+    Clog log;
+
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    imprintLinearAllocatorInit(&allocator, benchMemory, sizeof(benchMemory), "bench");
+    nbsStepsInit(steps, &allocator.info, BENCH_MAX_PAYLOAD_OCTET_COUNT, log);
+    nbsStepsReInit(steps, startId);
+}
+
+static void benchFill(NbsSteps* steps, size_t count, size_t payloadOctetCount)
+{
+    for (size_t i = 0; i < count; ++i) {
+        nbsStepsWrite(steps, steps->expectedWriteId, benchPayload, payloadOctetCount);
+    }
+}
+
+static void benchWrite(size_t fillCount, size_t payloadOctetCount)
+{
+    NbsSteps steps;
+    benchInitSteps(&steps, 0x1000);
+    benchFill(&steps, fillCount, payloadOctetCount);
+
+    benchBegin("nbsStepsWrite", fillCount, payloadOctetCount, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            nbsStepsWrite(&steps, steps.expectedWriteId, benchPayload, payloadOctetCount);
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+        nbsStepsDiscardCount(&steps, BENCH_BATCH_SIZE);
+    }
+    benchEnd();
+}
+
+static void benchRead(size_t fillCount, size_t payloadOctetCount)
+{
+    NbsSteps steps;
+    benchInitSteps(&steps, 0x1000);
+    benchFill(&steps, fillCount + BENCH_BATCH_SIZE, payloadOctetCount);
+
+    uint8_t target[BENCH_MAX_PAYLOAD_OCTET_COUNT];
+    volatile int sink = 0;
+
+    benchBegin("nbsStepsRead", fillCount, payloadOctetCount, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            StepId stepId;
+            sink += nbsStepsRead(&steps, &stepId, target, sizeof(target));
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+        benchFill(&steps, BENCH_BATCH_SIZE, payloadOctetCount);
+    }
+    (void) sink;
+    benchEnd();
+}
+
+static void benchReadAtIndex(size_t fillCount, size_t payloadOctetCount)
+{
+    NbsSteps steps;
+    StepId startId = 0x1000;
+    benchInitSteps(&steps, startId);
+    benchFill(&steps, fillCount, payloadOctetCount);
+
+    uint8_t target[BENCH_MAX_PAYLOAD_OCTET_COUNT];
+    volatile int sink = 0;
+    size_t lookup = 0;
+
+    benchBegin("nbsStepsReadAtIndex", fillCount, payloadOctetCount, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            lookup = (lookup + 7) % fillCount;
+            int index = nbsStepsGetIndexForStep(&steps, startId + (StepId) lookup);
+            sink += nbsStepsReadAtIndex(&steps, index, target, sizeof(target));
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    (void) sink;
+    benchEnd();
+}
+
+static void benchGetIndexForStep(size_t fillCount)
+{
+    NbsSteps steps;
+    StepId startId = 0x1000;
+    benchInitSteps(&steps, startId);
+    benchFill(&steps, fillCount, 16);
+
+    volatile int sink = 0;
+
+    benchBegin("nbsStepsGetIndexForStep", fillCount, 16, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            // Favor the newest steps, since those are the worst case for a linear scan from the tail
+            StepId lookupId = startId + (StepId) (fillCount - 1 - (i % fillCount));
+            sink += nbsStepsGetIndexForStep(&steps, lookupId);
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    (void) sink;
+    benchEnd();
+}
+
+static void benchDiscardUpTo(size_t fillCount, size_t payloadOctetCount)
+{
+    NbsSteps steps;
+    benchInitSteps(&steps, 0x1000);
+
+    benchBegin("nbsStepsDiscardUpTo", fillCount, payloadOctetCount, 1);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        benchFill(&steps, fillCount, payloadOctetCount);
+        StepId discardTo = steps.expectedWriteId;
+        uint64_t before = benchNanoseconds();
+        nbsStepsDiscardUpTo(&steps, discardTo);
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    benchEnd();
+}
+
+/// Subscriber i has not acknowledged the last 1 + i % lagCount steps
+static void benchSubscriberReceiveMask(const NbsSteps* steps, size_t subscriber, size_t lagCount,
+                                       NimbleStepsReceiveMask* receiveMask)
+{
+    receiveMask->expectingWriteId = steps->expectedWriteId - 1 - (StepId) (subscriber % lagCount);
+    receiveMask->receiveMask = NimbleStepsReceiveMaskAllReceived;
+}
+
+/// Serializes the unacknowledged steps for each subscriber separately. The lag count is reported in the fill column.
+static void benchRedundantStepsPerSubscriber(size_t lagCount, size_t payloadOctetCount)
+{
+    NbsSteps steps;
+    benchInitSteps(&steps, 0x1000);
+    benchFill(&steps, 60, payloadOctetCount);
+
+    uint8_t datagram[BENCH_DATAGRAM_OCTET_COUNT];
+    volatile int sink = 0;
+    size_t subscriber = 0;
+
+    benchBegin("nbsRedundantStepsWrite", lagCount, payloadOctetCount, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            NimbleStepsReceiveMask receiveMask;
+            benchSubscriberReceiveMask(&steps, subscriber, lagCount, &receiveMask);
+            FldOutStream stream;
+            fldOutStreamInit(&stream, datagram, sizeof(datagram));
+            sink += nbsRedundantStepsWrite(&steps, &receiveMask, &stream, sizeof(datagram));
+            subscriber = (subscriber + 1) % BENCH_SUBSCRIBER_COUNT;
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    (void) sink;
+    benchEnd();
+}
+
+/// Creates the same datagrams from steps that are serialized once. The lag count is reported in the fill column.
+static void benchFanOutDatagram(size_t lagCount, size_t payloadOctetCount)
+{
+    NbsSteps steps;
+    benchInitSteps(&steps, 0x1000);
+    benchFill(&steps, 60, payloadOctetCount);
+
+    ImprintLinearAllocator allocator;
+    imprintLinearAllocatorInit(&allocator, benchFanOutMemory, sizeof(benchFanOutMemory), "benchFanOut");
+    NbsStepsFanOut fanOut;
+    nbsStepsFanOutInit(&fanOut, &allocator.info, &steps, BENCH_SUBSCRIBER_COUNT, steps.log);
+    nbsStepsFanOutUpdate(&fanOut);
+    for (size_t subscriber = 0; subscriber < BENCH_SUBSCRIBER_COUNT; ++subscriber) {
+        NimbleStepsReceiveMask receiveMask;
+        benchSubscriberReceiveMask(&steps, subscriber, lagCount, &receiveMask);
+        nbsStepsFanOutAck(&fanOut, subscriber, &receiveMask);
+    }
+
+    NbsStepsFanOutDatagram datagram;
+    volatile int sink = 0;
+    size_t subscriber = 0;
+
+    benchBegin("nbsStepsFanOutDatagram", lagCount, payloadOctetCount, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            sink += nbsStepsFanOutDatagram(&fanOut, subscriber, BENCH_DATAGRAM_OCTET_COUNT, &datagram);
+            subscriber = (subscriber + 1) % BENCH_SUBSCRIBER_COUNT;
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    (void) sink;
+    benchEnd();
+}
+
+/// The out of order distance is reported in the fill column
+static void benchReceiveMask(size_t outOfOrderDistance)
+{
+    NimbleStepsReceiveMask receiveMask;
+    StepId startId = 0x1000;
+    nimbleStepsReceiveMaskInit(&receiveMask, startId);
+
+    StepId nextId = startId;
+    volatile int sink = 0;
+
+    benchBegin("nimbleStepsReceiveMaskReceivedStep", outOfOrderDistance, 0, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            // Every other step arrives late, outOfOrderDistance steps after it was expected
+            StepId receivedId = (i & 1) ? nextId - (StepId) outOfOrderDistance : nextId;
+            sink += nimbleStepsReceiveMaskReceivedStep(&receiveMask, receivedId);
+            nextId++;
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    (void) sink;
+    benchEnd();
+}
+
+static void benchReceiveMaskWide(size_t outOfOrderDistance)
+{
+    NimbleStepsReceiveMaskWide receiveMask;
+    StepId startId = 0x1000;
+    nimbleStepsReceiveMaskWideInit(&receiveMask, startId, 256);
+
+    StepId nextId = startId;
+    volatile int sink = 0;
+
+    benchBegin("nimbleStepsReceiveMaskWideReceivedStep", outOfOrderDistance, 0, BENCH_BATCH_SIZE);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        for (size_t i = 0; i < BENCH_BATCH_SIZE; ++i) {
+            StepId receivedId = (i & 1) ? nextId - (StepId) outOfOrderDistance : nextId;
+            sink += nimbleStepsReceiveMaskWideReceivedStep(&receiveMask, receivedId);
+            nextId++;
+        }
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    (void) sink;
+    benchEnd();
+}
+
+/// Aligns the receive masks of all connections to one head. The connection count is reported in the fill column.
+static void benchReceiveMaskTableAckMasks(void)
+{
+    ImprintLinearAllocator allocator;
+    imprintLinearAllocatorInit(&allocator, benchFanOutMemory, sizeof(benchFanOutMemory), "benchReceiveMaskTable");
+    NimbleStepsReceiveMaskTable table;
+    StepId startId = 0x1000;
+    nimbleStepsReceiveMaskTableInit(&table, &allocator.info, BENCH_SUBSCRIBER_COUNT, startId);
+
+    // Each connection has received a different number of steps, with a hole in every other one
+    for (uint32_t connection = 0; connection < BENCH_SUBSCRIBER_COUNT; ++connection) {
+        for (StepId i = 0; i < connection % 40; ++i) {
+            if ((connection & 1) == 0 || i != 2) {
+                NimbleStepsReceiveMaskArrival arrival = {connection, startId + i};
+                nimbleStepsReceiveMaskTableReceivedSteps(&table, &arrival, 1);
+            }
+        }
+    }
+
+    benchBegin("nimbleStepsReceiveMaskTableAckMasks", BENCH_SUBSCRIBER_COUNT, 0, BENCH_SUBSCRIBER_COUNT);
+    for (size_t sample = 0; sample < benchSampleCount; ++sample) {
+        uint64_t before = benchNanoseconds();
+        nimbleStepsReceiveMaskTableAckMasks(&table, startId + 40, benchAckMasks);
+        uint64_t after = benchNanoseconds();
+        benchAddSample(before, after);
+    }
+    benchEnd();
+}
+
+int main(int argc, char* argv[])
+{
+    g_clog.log = clog_console;
+    g_clog.level = CLOG_TYPE_WARN;
+
+    if (argc > 1) {
+        benchSampleCount = (size_t) strtoul(argv[1], 0, 10);
+        if (benchSampleCount == 0 || benchSampleCount > BENCH_MAX_SAMPLE_COUNT) {
+            fprintf(stderr, "usage: %s [sample count, 1-%d]\n", argv[0], BENCH_MAX_SAMPLE_COUNT);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(benchPayload); ++i) {
+        benchPayload[i] = (uint8_t) i;
+    }
+
+    // The default window holds at most NBS_WINDOW_SIZE / 2 steps, leave room for a batch on top of the fill
+    static const size_t fillCounts[] = {1, 30, 60, 100};
+    static const size_t payloadOctetCounts[] = {8, 64, 256, 512};
+
+    for (size_t f = 0; f < sizeof(fillCounts) / sizeof(fillCounts[0]); ++f) {
+        benchGetIndexForStep(fillCounts[f]);
+    }
+
+    for (size_t p = 0; p < sizeof(payloadOctetCounts) / sizeof(payloadOctetCounts[0]); ++p) {
+        for (size_t f = 0; f < sizeof(fillCounts) / sizeof(fillCounts[0]); ++f) {
+            size_t fillCount = fillCounts[f];
+            size_t payloadOctetCount = payloadOctetCounts[p];
+            benchWrite(fillCount, payloadOctetCount);
+            benchRead(fillCount, payloadOctetCount);
+            benchReadAtIndex(fillCount, payloadOctetCount);
+            benchDiscardUpTo(fillCount, payloadOctetCount);
+        }
+    }
+
+    static const size_t outOfOrderDistances[] = {1, 8, 32};
+    for (size_t i = 0; i < sizeof(outOfOrderDistances) / sizeof(outOfOrderDistances[0]); ++i) {
+        benchReceiveMask(outOfOrderDistances[i]);
+        benchReceiveMaskWide(outOfOrderDistances[i]);
+    }
+    benchReceiveMaskTableAckMasks();
+
+    static const size_t lagCounts[] = {1, 4, 16};
+    for (size_t i = 0; i < sizeof(lagCounts) / sizeof(lagCounts[0]); ++i) {
+        benchRedundantStepsPerSubscriber(lagCounts[i], 64);
+        benchFanOutDatagram(lagCounts[i], 64);
+    }
+
+    return 0;
+}
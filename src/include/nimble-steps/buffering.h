@@ -0,0 +1,48 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_BUFFERING_H
+#define NIMBLE_STEPS_BUFFERING_H
+
+#include <nimble-steps/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct NbsSteps;
+
+typedef enum NbsStepsBufferingAction {
+    NbsStepsBufferingActionKeep,
+    NbsStepsBufferingActionCatchUp,
+    NbsStepsBufferingActionSlowDown,
+} NbsStepsBufferingAction;
+
+/// What the consumer should do to move the buffer depth towards the target depth
+typedef struct NbsStepsBufferingAdvice {
+    NbsStepsBufferingAction action;
+    int tickRateAdjustmentPermille;
+    size_t targetDepth;
+} NbsStepsBufferingAdvice;
+
+/// Jitter buffer policy. Picks the target depth of a steps buffer from the variance of the step arrival times.
+/// The mean and variance are exponential moving averages in fixed point, scaled by 16.
+typedef struct NbsStepsBuffering {
+    uint64_t tickInterval;
+    size_t minDepth;
+    size_t maxDepth;
+    size_t targetDepth;
+    StepId lastSeenWriteId;
+    uint64_t lastSeenTime;
+    bool hasLastSeenTime;
+    int64_t meanIntervalScaled;
+    int64_t varianceScaled;
+    size_t lowerTargetCount;
+    size_t sampleCount;
+} NbsStepsBuffering;
+
+void nbsStepsBufferingInit(NbsStepsBuffering* self, uint64_t tickInterval, size_t minDepth, size_t maxDepth);
+NbsStepsBufferingAdvice nbsStepsBufferingUpdate(NbsStepsBuffering* self, struct NbsSteps* steps);
+uint64_t nbsStepsBufferingJitter(const NbsStepsBuffering* self);
+
+#endif
@@ -0,0 +1,33 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_COMBINED_STEP_H
+#define NIMBLE_STEPS_COMBINED_STEP_H
+
+#include <nimble-steps/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct NbsSteps;
+
+/// Builds a combined step in place in the steps buffer, one participant input at a time.
+/// Format: participant count (uint8), then for each participant: participant id (uint8), octet count (uint8) and the
+/// input octets.
+typedef struct NbsCombinedStepComposer {
+    struct NbsSteps* steps;
+    uint8_t* payload;
+    size_t maxOctetCount;
+    size_t octetCount;
+    size_t participantCount;
+    uint64_t participantIdMask;
+    bool isComposing;
+} NbsCombinedStepComposer;
+
+int nbsCombinedStepComposerBegin(NbsCombinedStepComposer* self, struct NbsSteps* steps, StepId stepId);
+int nbsCombinedStepComposerAdd(NbsCombinedStepComposer* self, uint8_t participantId, const uint8_t* input,
+                               size_t octetCount);
+int nbsCombinedStepComposerCommit(NbsCombinedStepComposer* self);
+void nbsCombinedStepComposerCancel(NbsCombinedStepComposer* self);
+
+#endif
@@ -0,0 +1,57 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_FAN_OUT_H
+#define NIMBLE_STEPS_FAN_OUT_H
+
+#include <clog/clog.h>
+#include <nimble-steps/receive_mask.h>
+#include <nimble-steps/types.h>
+#include <stddef.h>
+
+struct ImprintAllocator;
+struct NbsSteps;
+
+#define NBS_STEPS_FAN_OUT_MAX_RANGE_COUNT (16)
+#define NBS_STEPS_FAN_OUT_MAX_SLICE_COUNT (NBS_STEPS_FAN_OUT_MAX_RANGE_COUNT * 3)
+
+typedef struct NbsStepsFanOutSlice {
+    const uint8_t* octets;
+    size_t octetCount;
+} NbsStepsFanOutSlice;
+
+/// A datagram payload in the nbsRedundantStepsWrite format, as a list of slices to send in order.
+/// The range headers are stored in the datagram itself, so it must not be copied or moved after it is filled out.
+/// The step slices point into the fan-out and are valid until the next nbsStepsFanOutUpdate.
+typedef struct NbsStepsFanOutDatagram {
+    uint8_t headers[1 + NBS_STEPS_FAN_OUT_MAX_RANGE_COUNT * 5];
+    NbsStepsFanOutSlice slices[NBS_STEPS_FAN_OUT_MAX_SLICE_COUNT];
+    size_t sliceCount;
+    size_t octetCount;
+} NbsStepsFanOutDatagram;
+
+/// Sends the steps of one authoritative steps buffer to many subscribers.
+/// Each step is serialized once, and the datagram for each subscriber refers to the serialized steps instead of
+/// copying them. The subscriber positions are kept in a table indexed by the subscriber, for example a connection index.
+typedef struct NbsStepsFanOut {
+    const struct NbsSteps* steps;
+    uint8_t* serialized;
+    size_t serializedCapacity;
+    size_t writeOffset;
+    size_t wrapEndOffset;
+    uint32_t* serializedOffsets;
+    StepId serializedUpToId;
+    NimbleStepsReceiveMaskTable subscribers;
+    Clog log;
+} NbsStepsFanOut;
+
+void nbsStepsFanOutInit(NbsStepsFanOut* self, struct ImprintAllocator* allocator, const struct NbsSteps* steps,
+                        size_t subscriberCount, Clog log);
+size_t nbsStepsFanOutUpdate(NbsStepsFanOut* self);
+void nbsStepsFanOutResetSubscriber(NbsStepsFanOut* self, size_t subscriberIndex, StepId expectingId);
+void nbsStepsFanOutAck(NbsStepsFanOut* self, size_t subscriberIndex, const NimbleStepsReceiveMask* receiveMask);
+int nbsStepsFanOutDatagram(const NbsStepsFanOut* self, size_t subscriberIndex, size_t maxOctetCount,
+                           NbsStepsFanOutDatagram* datagram);
+
+#endif
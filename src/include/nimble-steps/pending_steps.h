@@ -0,0 +1,63 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_PENDING_STEPS_H
+#define NIMBLE_STEPS_PENDING_STEPS_H
+
+#include <clog/clog.h>
+#include <nimble-steps/receive_mask.h>
+#include <nimble-steps/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ImprintAllocator;
+struct NbsSteps;
+
+#define NBS_PENDING_STEPS_WINDOW_SIZE (64)
+#define NBS_PENDING_STEPS_MAX_WINDOW_SIZE (NIMBLE_STEPS_RECEIVE_MASK_WIDE_MAX_WORD_COUNT * 64)
+
+typedef struct NbsPendingStep {
+    size_t octetCount;
+    StepId idForDebug;
+    bool isInUse;
+} NbsPendingStep;
+
+typedef struct NbsPendingRange {
+    StepId startId;
+    size_t count;
+} NbsPendingRange;
+
+/// Receives steps in any order within a window and hands them out in order.
+/// Each step is stored in the slot given by its StepId, so no allocations are done after init.
+typedef struct NbsPendingSteps {
+    NbsPendingStep* steps;
+    uint8_t* payloads;
+    size_t windowSize;
+    size_t maxOctetCountPerStep;
+    StepId expectingReadId;
+    size_t storedCount;
+    NimbleStepsReceiveMaskWide receiveMask;
+    Clog log;
+} NbsPendingSteps;
+
+void nbsPendingStepsInit(NbsPendingSteps* self, StepId lateJoinStepId, struct ImprintAllocator* allocator,
+                         size_t maxOctetCountPerStep, Clog log);
+void nbsPendingStepsInitWithWindowSize(NbsPendingSteps* self, StepId lateJoinStepId, struct ImprintAllocator* allocator,
+                                       size_t maxOctetCountPerStep, size_t windowSize, Clog log);
+void nbsPendingStepsReset(NbsPendingSteps* self, StepId lateJoinStepId);
+int nbsPendingStepsTrySet(NbsPendingSteps* self, StepId stepId, const uint8_t* payload, size_t octetCount);
+bool nbsPendingStepsCanBeAdvanced(const NbsPendingSteps* self);
+int nbsPendingStepsTryRead(NbsPendingSteps* self, const uint8_t** outPayload, size_t* outOctetCount,
+                           StepId* outStepId);
+int nbsPendingStepsCopy(NbsPendingSteps* self, struct NbsSteps* target);
+NimbleStepsReceiveMaskBits nbsPendingStepsReceiveMask(const NbsPendingSteps* self, StepId* headId);
+const NimbleStepsReceiveMaskWide* nbsPendingStepsReceiveMaskWide(const NbsPendingSteps* self);
+int nbsPendingStepsRanges(StepId headId, StepId lastAvailableId, NimbleStepsReceiveMaskBits mask,
+                          NbsPendingRange* ranges, size_t maxRangeCount, size_t maxStepCount);
+int nbsPendingStepsRangesWide(const NimbleStepsReceiveMaskWide* mask, StepId lastAvailableId, NbsPendingRange* ranges,
+                              size_t maxRangeCount, size_t maxStepCount);
+void nbsPendingStepsRangesDebugOutput(const NbsPendingRange* ranges, const char* debug, size_t rangeCount, Clog log);
+void nbsPendingStepsDebugOutput(const NbsPendingSteps* self, const char* debug);
+
+#endif
@@ -10,6 +10,8 @@
 #include <stdint.h>
 #include <clog/clog.h>
 
+struct ImprintAllocator;
+
 typedef uint64_t NimbleStepsReceiveMaskBits;
 
 typedef struct NimbleStepsReceiveMask {
@@ -19,8 +21,46 @@ typedef struct NimbleStepsReceiveMask {
 
 static const NimbleStepsReceiveMaskBits NimbleStepsReceiveMaskAllReceived = UINT64_MAX;
 
+#define NIMBLE_STEPS_RECEIVE_MASK_WIDE_MAX_WORD_COUNT (4)
+
+/// Receive mask that covers 64, 128, 192 or 256 steps.
+/// Bit zero in word zero is the step right before expectingWriteId, word one continues with older steps and so on.
+typedef struct NimbleStepsReceiveMaskWide {
+    StepId expectingWriteId;
+    size_t wordCount;
+    NimbleStepsReceiveMaskBits words[NIMBLE_STEPS_RECEIVE_MASK_WIDE_MAX_WORD_COUNT];
+} NimbleStepsReceiveMaskWide;
+
+typedef struct NimbleStepsReceiveMaskArrival {
+    uint32_t connectionIndex;
+    StepId stepId;
+} NimbleStepsReceiveMaskArrival;
+
+/// Receive masks for many connections, stored as one array of expected stepIds and one array of mask bits
+typedef struct NimbleStepsReceiveMaskTable {
+    StepId* expectingWriteIds;
+    NimbleStepsReceiveMaskBits* receiveMasks;
+    size_t connectionCount;
+} NimbleStepsReceiveMaskTable;
+
 void nimbleStepsReceiveMaskInit(NimbleStepsReceiveMask* self, StepId startId);
 int nimbleStepsReceiveMaskReceivedStep(NimbleStepsReceiveMask* self, StepId startId);
 void nimbleStepsReceiveMaskDebugMask(const NimbleStepsReceiveMask* self, const char* debug, Clog log);
 
+void nimbleStepsReceiveMaskWideInit(NimbleStepsReceiveMaskWide* self, StepId startId, size_t bitCount);
+int nimbleStepsReceiveMaskWideReceivedStep(NimbleStepsReceiveMaskWide* self, StepId stepId);
+bool nimbleStepsReceiveMaskWideIsReceived(const NimbleStepsReceiveMaskWide* self, StepId stepId);
+size_t nimbleStepsReceiveMaskWideMissingCount(const NimbleStepsReceiveMaskWide* self);
+void nimbleStepsReceiveMaskWideDebugMask(const NimbleStepsReceiveMaskWide* self, const char* debug, Clog log);
+
+void nimbleStepsReceiveMaskTableInit(NimbleStepsReceiveMaskTable* self, struct ImprintAllocator* allocator,
+                                     size_t connectionCount, StepId startId);
+void nimbleStepsReceiveMaskTableReset(NimbleStepsReceiveMaskTable* self, size_t connectionIndex, StepId startId);
+void nimbleStepsReceiveMaskTableGet(const NimbleStepsReceiveMaskTable* self, size_t connectionIndex,
+                                    NimbleStepsReceiveMask* receiveMask);
+size_t nimbleStepsReceiveMaskTableReceivedSteps(NimbleStepsReceiveMaskTable* self,
+                                                const NimbleStepsReceiveMaskArrival* arrivals, size_t arrivalCount);
+void nimbleStepsReceiveMaskTableAckMasks(const NimbleStepsReceiveMaskTable* self, StepId headId,
+                                         NimbleStepsReceiveMaskBits* ackMasks);
+
 #endif
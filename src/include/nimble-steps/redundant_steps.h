@@ -0,0 +1,22 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_REDUNDANT_STEPS_H
+#define NIMBLE_STEPS_REDUNDANT_STEPS_H
+
+#include <nimble-steps/receive_mask.h>
+#include <stddef.h>
+
+struct NbsSteps;
+struct FldOutStream;
+
+/// Maximum number of steps in a single range in the serialized format
+#define NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT (255)
+
+int nbsRedundantStepsWrite(const struct NbsSteps* steps, const NimbleStepsReceiveMask* receiveMask,
+                           struct FldOutStream* stream, size_t maxOctetCount);
+int nbsRedundantStepsWriteWide(const struct NbsSteps* steps, const NimbleStepsReceiveMaskWide* receiveMask,
+                               struct FldOutStream* stream, size_t maxOctetCount);
+
+#endif
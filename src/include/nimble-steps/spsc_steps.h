@@ -0,0 +1,57 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_SPSC_STEPS_H
+#define NIMBLE_STEPS_SPSC_STEPS_H
+
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+
+struct ImprintAllocator;
+
+#define NBS_SPSC_CACHE_LINE_SIZE (64)
+
+#if defined _MSC_VER
+#define NBS_SPSC_CACHE_LINE_ALIGNED __declspec(align(NBS_SPSC_CACHE_LINE_SIZE))
+#else
+#define NBS_SPSC_CACHE_LINE_ALIGNED __attribute__((aligned(NBS_SPSC_CACHE_LINE_SIZE)))
+#endif
+
+/// Steps buffer for exactly one writing thread (producer) and one reading thread (consumer).
+/// The threads only synchronize through the acquire/release counters, no locks are used.
+/// The producer fields, the consumer fields and the fields that are not changed after init are each on their own
+/// cache line, so a write only invalidates the line of the other thread when a counter is published.
+/// The struct is aligned to NBS_SPSC_CACHE_LINE_SIZE, memory for it that is not a variable, e.g. from an allocator,
+/// must be aligned to NBS_SPSC_CACHE_LINE_SIZE as well.
+typedef struct NbsSpscSteps {
+    // Written by the producer, writtenCount is read by the consumer
+    NBS_SPSC_CACHE_LINE_ALIGNED size_t writtenCount;
+    StepId expectedWriteId;
+    size_t writeOctetIndex;
+
+    // Written by the consumer, readCount is read by the producer
+    NBS_SPSC_CACHE_LINE_ALIGNED size_t readCount;
+    StepId expectedReadId;
+
+    // Not changed after init
+    NBS_SPSC_CACHE_LINE_ALIGNED uint8_t* payload;
+    size_t payloadCapacity;
+    StepInfo* infos;
+    size_t windowSize;
+    Clog log;
+} NbsSpscSteps;
+
+int nbsSpscStepsInit(NbsSpscSteps* self, struct ImprintAllocator* allocator, size_t maxOctetSizeForCombinedStep,
+                     size_t windowSize, Clog log);
+void nbsSpscStepsReInit(NbsSpscSteps* self, StepId initialId);
+size_t nbsSpscStepsCount(const NbsSpscSteps* self);
+
+int nbsSpscStepsWrite(NbsSpscSteps* self, StepId stepId, const uint8_t* data, size_t octetCount);
+
+int nbsSpscStepsRead(NbsSpscSteps* self, StepId* stepId, uint8_t* data, size_t maxTarget);
+int nbsSpscStepsPeekView(const NbsSpscSteps* self, NbsStepView* view);
+int nbsSpscStepsDiscardCount(NbsSpscSteps* self, size_t stepCountToDiscard);
+
+#endif
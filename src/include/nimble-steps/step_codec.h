@@ -0,0 +1,43 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_STEP_CODEC_H
+#define NIMBLE_STEPS_STEP_CODEC_H
+
+#include <nimble-steps/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct NbsSteps;
+
+#define NBS_STEP_CODEC_MAX_OCTET_COUNT (512)
+/// Encoded steps are never more than this many octets larger than the step itself
+#define NBS_STEP_CODEC_MAX_OVERHEAD_OCTET_COUNT (16)
+/// The encoder writes a keyframe, a step that does not depend on the previous one, at least this often
+#define NBS_STEP_CODEC_KEYFRAME_INTERVAL (32)
+
+/// Delta codec for steps. Each step is XORed with the previous step and the zero runs are run-length encoded.
+/// The encoder and the decoder each keep a copy of the previous step, so delta steps must be decoded in the same order
+/// as they were encoded. Keyframes can always be decoded, so a decoder that missed a step recovers at the next one.
+/// Format: octet count shifted up one bit with the lowest bit set for a delta step (varint), then pairs of zero run
+/// length (varint) and literal length (varint) followed by the literal XORed octets.
+typedef struct NbsStepCodec {
+    uint8_t previous[NBS_STEP_CODEC_MAX_OCTET_COUNT];
+    size_t previousOctetCount;
+    bool hasPrevious;
+    StepId previousStepId;
+    size_t deltaCount;
+} NbsStepCodec;
+
+void nbsStepCodecInit(NbsStepCodec* self);
+int nbsStepCodecEncode(NbsStepCodec* self, const uint8_t* step, size_t octetCount, uint8_t* target, size_t maxTarget);
+int nbsStepCodecDecode(NbsStepCodec* self, const uint8_t* encoded, size_t encodedOctetCount, uint8_t* target,
+                       size_t maxTarget);
+int nbsStepsWriteDelta(struct NbsSteps* steps, NbsStepCodec* encoder, StepId stepId, const uint8_t* step,
+                       size_t octetCount);
+int nbsStepsReadDelta(struct NbsSteps* steps, NbsStepCodec* decoder, StepId* stepId, uint8_t* target,
+                      size_t maxTarget);
+
+#endif
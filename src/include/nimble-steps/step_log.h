@@ -0,0 +1,79 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_STEP_LOG_H
+#define NIMBLE_STEPS_STEP_LOG_H
+
+#include <clog/clog.h>
+#include <nimble-steps/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NBS_STEP_LOG_MAX_PATH_LENGTH (256)
+
+/// Start of each segment file. The StepId offset table and the step records follow directly after.
+typedef struct NbsStepLogSegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t firstStepId;
+    uint32_t stepCapacity;
+    uint32_t stepCount;
+    uint32_t octetCount;
+    uint32_t maxOctetCountPerStep;
+    uint32_t reserved;
+} NbsStepLogSegmentHeader;
+
+typedef struct NbsStepLogSegment {
+    int fileDescriptor;
+    uint8_t* octets;
+    size_t octetCount;
+    size_t index;
+} NbsStepLogSegment;
+
+/// Append-only log of steps, stored in memory mapped segment files named basePath.000000, basePath.000001 and so on.
+/// Each segment holds a fixed number of consecutive steps, so the segment and record for a StepId are found in O(1).
+/// Values are stored in the native byte order.
+typedef struct NbsStepLog {
+    NbsStepLogSegment segment;
+    StepId firstStepId;
+    StepId nextStepId;
+    size_t stepCapacityPerSegment;
+    size_t maxOctetCountPerStep;
+    size_t writeOffset;
+    uint64_t time;
+    bool isOpen;
+    char basePath[NBS_STEP_LOG_MAX_PATH_LENGTH];
+    Clog log;
+} NbsStepLog;
+
+/// Random access to a step log written by NbsStepLog. One segment is mapped at a time.
+typedef struct NbsStepLogReader {
+    NbsStepLogSegment segment;
+    StepId firstStepId;
+    size_t stepCapacityPerSegment;
+    bool isOpen;
+    char basePath[NBS_STEP_LOG_MAX_PATH_LENGTH];
+    Clog log;
+} NbsStepLogReader;
+
+typedef struct NbsStepLogRecord {
+    StepId stepId;
+    uint64_t time;
+    const uint8_t* payload;
+    size_t octetCount;
+} NbsStepLogRecord;
+
+int nbsStepLogCreate(NbsStepLog* self, const char* basePath, StepId firstStepId, size_t stepCapacityPerSegment,
+                     size_t maxOctetCountPerStep, Clog log);
+int nbsStepLogAppend(NbsStepLog* self, StepId stepId, uint64_t time, const uint8_t* payload, size_t octetCount);
+void nbsStepLogSetTime(NbsStepLog* self, uint64_t time);
+void nbsStepLogWriteListener(void* self, StepId stepId, const uint8_t* payload, size_t octetCount);
+int nbsStepLogClose(NbsStepLog* self);
+
+int nbsStepLogReaderOpen(NbsStepLogReader* self, const char* basePath, Clog log);
+int nbsStepLogReaderRead(NbsStepLogReader* self, StepId stepId, NbsStepLogRecord* record);
+void nbsStepLogReaderClose(NbsStepLogReader* self);
+
+#endif
@@ -7,29 +7,111 @@
 
 #include <clog/clog.h>
 #include <discoid/circular_buffer.h>
+#include <nimble-steps/step.h>
 #include <nimble-steps/types.h>
 #include <stdbool.h>
 
 #define NBS_WINDOW_SIZE (240)
-#define NBS_RETREAT(index) tc_modulo((index - 1), NBS_WINDOW_SIZE)
 
+#define NBS_STEPS_ARRIVAL_HISTOGRAM_BUCKET_COUNT (252)
+#define NBS_STEPS_MAX_CURSOR_COUNT (8)
+#define NBS_STEPS_STATS_DEPTH_BUCKET_COUNT (33)
+#define NBS_STEPS_STATS_OCTET_BUCKET_COUNT (12)
+
+struct FldOutStream;
+
+/// Where a step payload is stored in the buffer. Eight octets, so a whole window index fits in a few cache lines.
+/// The StepId is not stored, it follows from the position in the window.
 typedef struct StepInfo {
-    size_t positionInBuffer;
-    size_t octetCount;
-    StepId stepId;
-    uint64_t optionalTime;
+    uint32_t positionInBuffer;
+    uint16_t octetCount;
 } StepInfo;
 
+/// Zero-copy view of a stored step. The payload is split into two spans if it wraps around the end of the buffer.
+typedef struct NbsStepView {
+    StepId stepId;
+    NimbleStep first;
+    NimbleStep second;
+} NbsStepView;
+
+/// Inter-arrival times of the steps written with nbsStepsWriteWithTime.
+/// The histogram has four buckets for each power of two, so percentiles are within 25%.
+typedef struct NbsStepsArrivalStats {
+    size_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint32_t histogram[NBS_STEPS_ARRIVAL_HISTOGRAM_BUCKET_COUNT];
+} NbsStepsArrivalStats;
+
+typedef struct NbsStepsArrivalSummary {
+    size_t count;
+    uint64_t min;
+    uint64_t average;
+    uint64_t percentile99;
+    uint64_t max;
+} NbsStepsArrivalSummary;
+
+/// Counters for the read and write paths, see nbsStepsSetStats.
+/// Dropped steps were rejected because the buffer was full. Late steps were rejected because they were already
+/// written, and out of order steps because they were ahead of the expected step id. A rejected step leaves the buffer
+/// unchanged. The depth histogram has one bucket for each step count and a last bucket for all deeper samples.
+/// Octet bucket n counts steps with an octet count in [2^(n-1), 2^n).
+typedef struct NbsStepsStats {
+    size_t writeCount;
+    size_t readCount;
+    size_t discardCount;
+    size_t droppedCount;
+    size_t lateCount;
+    size_t outOfOrderCount;
+    size_t peakStepCount;
+    size_t depthHistogram[NBS_STEPS_STATS_DEPTH_BUCKET_COUNT];
+    size_t octetCountHistogram[NBS_STEPS_STATS_OCTET_BUCKET_COUNT];
+} NbsStepsStats;
+
+/// Called for every step that is added to the buffer
+typedef void (*NbsStepsWriteListenerFn)(void* userData, StepId stepId, const uint8_t* payload, size_t octetCount);
+
+/// The read position of a steps buffer, see nbsStepsSnapshot
+typedef struct NbsStepsSnapshot {
+    StepId readId;
+    size_t infoTailIndex;
+    size_t readIndex;
+    uint64_t tailPrefixHash;
+} NbsStepsSnapshot;
+
 typedef struct NbsSteps {
     DiscoidBuffer stepsData;
     size_t stepsCount;
     size_t waitCounter;
+    size_t targetDepth;
     StepId expectedWriteId;
     StepId expectedReadId;
-    StepInfo infos[NBS_WINDOW_SIZE];
+    StepInfo* infos;
+    uint64_t* times;
+    uint64_t headTime;
+    bool hasHeadTime;
+    NbsStepsArrivalStats arrivalStats;
+    uint64_t* prefixHashes;
+    uint64_t tailPrefixHash;
+    uint64_t headPrefixHash;
+    bool isRangeHashEnabled;
+    size_t windowSize;
+    size_t windowIndexMask;
     size_t infoHeadIndex;
     size_t infoTailIndex;
+    size_t maxStepOctetCount;
+    size_t reservedOctetCount;
+    NbsStepsSnapshot retained;
+    bool isRetaining;
+    StepId cursorReadIds[NBS_STEPS_MAX_CURSOR_COUNT];
+    uint32_t cursorMask;
+    size_t cursorKeptPosition;
+    bool hasCursorKeptStep;
+    NbsStepsStats* stats;
     bool isInitialized;
+    NbsStepsWriteListenerFn writeListener;
+    void* writeListenerUserData;
     uint32_t warningAboutSkippedSteps;
     Clog log;
 } NbsSteps;
@@ -37,6 +119,9 @@ typedef struct NbsSteps {
 int nbsStepsVerifyStep(const uint8_t* payload, size_t octetCount);
 size_t nbsStepsDropped(const NbsSteps* self, StepId firstReadStepId);
 void nbsStepsInit(NbsSteps* self, struct ImprintAllocator* allocator, size_t maxTarget, Clog log);
+void nbsStepsInitWithWindowSize(NbsSteps* self, struct ImprintAllocator* allocator, size_t maxOctetSizeForCombinedStep,
+                                size_t windowSize, Clog log);
+size_t nbsStepsFootprint(size_t maxOctetSizeForCombinedStep, size_t windowSize);
 void nbsStepsReInit(NbsSteps* self, StepId initialId);
 void nbsStepsReset(NbsSteps* self);
 bool nbsStepsLatestStepId(const NbsSteps* self, StepId* id);
@@ -44,14 +129,45 @@ size_t nbsStepsCount(const NbsSteps* self);
 int nbsStepsRead(NbsSteps* self, StepId* stepId, uint8_t* data, size_t maxTarget);
 int nbsStepsReadExactStepId(NbsSteps* self, StepId stepId, uint8_t* data, size_t maxTarget);
 int nbsStepsWrite(NbsSteps* self, StepId stepId, const uint8_t* data, size_t stepSize);
+int nbsStepsWriteWithTime(NbsSteps* self, StepId stepId, uint64_t time, const uint8_t* data, size_t stepSize);
+int nbsStepsWriteBatch(NbsSteps* self, StepId firstStepId, const uint8_t* packedPayloads, const size_t* octetCounts,
+                       size_t stepCount);
+int nbsStepsWriteReserve(NbsSteps* self, StepId stepId, size_t maxOctetCount, uint8_t** outPayload);
+int nbsStepsWriteCommit(NbsSteps* self, size_t octetCount);
+void nbsStepsWriteCancel(NbsSteps* self);
+int nbsStepsWriteReserveStream(NbsSteps* self, StepId stepId, size_t maxOctetCount, struct FldOutStream* stream);
+int nbsStepsWriteCommitStream(NbsSteps* self, const struct FldOutStream* stream);
+void nbsStepsSetWriteListener(NbsSteps* self, NbsStepsWriteListenerFn listener, void* userData);
+void nbsStepsSetRangeHashEnabled(NbsSteps* self, bool isEnabled);
+int nbsStepsRangeHash(const NbsSteps* self, StepId fromStepId, StepId toStepId, uint64_t* hash);
+int nbsStepsTimeForStep(const NbsSteps* self, StepId stepId, uint64_t* time);
+int nbsStepsFindFirstAtOrAfterTime(const NbsSteps* self, uint64_t time, StepId* stepId);
+void nbsStepsArrivalSummary(const NbsSteps* self, NbsStepsArrivalSummary* summary);
+void nbsStepsResetArrivalStats(NbsSteps* self);
 bool nbsStepsPeek(NbsSteps* self, StepId* stepId);
 int nbsStepsDiscard(NbsSteps* self, StepId* stepId);
 int nbsStepsDiscardUpTo(NbsSteps* self, StepId stepIdToDiscardTo);
 int nbsStepsDiscardIncluding(NbsSteps* self, StepId stepIdToDiscardTo);
 int nbsStepsDiscardCount(NbsSteps* self, size_t stepCountToDiscard);
 bool nbsStepsAllowedToAdd(const NbsSteps* self);
+bool nbsStepsHasRoomFor(const NbsSteps* self, size_t octetCount);
+void nbsStepsSetTargetDepth(NbsSteps* self, size_t targetDepth);
+void nbsStepsSnapshot(const NbsSteps* self, NbsStepsSnapshot* snapshot);
+int nbsStepsRetain(NbsSteps* self, const NbsStepsSnapshot* snapshot);
+void nbsStepsReleaseRetained(NbsSteps* self);
+int nbsStepsRestore(NbsSteps* self, const NbsStepsSnapshot* snapshot);
+int nbsStepsCursorAdd(NbsSteps* self);
+void nbsStepsCursorRemove(NbsSteps* self, int cursorIndex);
+size_t nbsStepsCursorCount(const NbsSteps* self, int cursorIndex);
+int nbsStepsCursorRead(NbsSteps* self, int cursorIndex, NbsStepView* view);
+void nbsStepsSetStats(NbsSteps* self, NbsStepsStats* stats);
+void nbsStepsStatsSampleDepth(NbsSteps* self);
+void nbsStepsStatsRead(const NbsStepsStats* stats, NbsStepsStats* target);
 int nbsStepsGetIndexForStep(const NbsSteps* self, StepId stepId);
 int nbsStepsReadAtIndex(const NbsSteps* self, int infoIndex, uint8_t* data, size_t maxTarget);
+int nbsStepsViewAtIndex(const NbsSteps* self, int infoIndex, NbsStepView* view);
+int nbsStepsPeekView(const NbsSteps* self, NbsStepView* view);
+int nbsStepsViewExactStepId(NbsSteps* self, StepId stepId, NbsStepView* view);
 void nbsStepsDebugOutput(const NbsSteps* self, const char* debug, int flags);
 
 #endif
@@ -0,0 +1,44 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_STEPS_ARENA_H
+#define NIMBLE_STEPS_STEPS_ARENA_H
+
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ImprintAllocator;
+
+#define NBS_STEPS_ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct NbsStepsArenaSlot {
+    NbsSteps steps;
+    size_t nextFreeIndex;
+    bool isInUse;
+} NbsStepsArenaSlot;
+
+/// Carves many steps buffers with the same configuration out of one slab of memory.
+/// All buffers are initialized up front, acquiring and releasing a buffer does not allocate.
+typedef struct NbsStepsArena {
+    NbsStepsArenaSlot* slots;
+    size_t slotCount;
+    size_t slotOctetCount;
+    size_t firstFreeIndex;
+    size_t acquiredCount;
+    uint8_t* slab;
+    Clog log;
+} NbsStepsArena;
+
+size_t nbsStepsArenaSlotOctetCount(size_t maxOctetSizeForCombinedStep, size_t windowSize);
+size_t nbsStepsArenaSlabOctetCount(size_t slotCount, size_t maxOctetSizeForCombinedStep, size_t windowSize);
+int nbsStepsArenaInit(NbsStepsArena* self, struct ImprintAllocator* allocator, uint8_t* slab, size_t slabOctetCount,
+                      size_t maxOctetSizeForCombinedStep, size_t windowSize, Clog log);
+int nbsStepsArenaAcquire(NbsStepsArena* self, StepId initialId, NbsSteps** outSteps);
+int nbsStepsArenaRelease(NbsStepsArena* self, NbsSteps* steps);
+size_t nbsStepsArenaAcquiredCount(const NbsStepsArena* self);
+size_t nbsStepsArenaFreeCount(const NbsStepsArena* self);
+
+#endif
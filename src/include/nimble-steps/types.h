@@ -5,6 +5,7 @@
 #ifndef NIMBLE_STEPS_TYPES_H
 #define NIMBLE_STEPS_TYPES_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint32_t StepId;
@@ -18,6 +19,35 @@ static const size_t NimbleStepMaxCombinedStepOctetCount = 512; // NimbleStepMaxS
 // NimbleStepMaxParticipantCount;
 static const size_t NimbleStepMinimumSingleStepOctetCount = 1u;
 
-static int NimbleStepErrCollectionIsEmpty = -1;
+/// Error codes returned by the library functions. Other negative values are passed through from the discoid buffer.
+typedef enum NimbleStepErr {
+    NimbleStepErrCollectionIsEmpty = -1,
+    NimbleStepErrStepNotFound = -2,
+    NimbleStepErrWrongOctetCount = -3,
+    NimbleStepErrWrongStepId = -4,
+    NimbleStepErrTargetTooSmall = -5,
+    NimbleStepErrBufferFull = -6,
+    NimbleStepErrReservation = -7,
+    NimbleStepErrTimeWentBackwards = -8,
+    NimbleStepErrIndexOutOfRange = -9,
+    NimbleStepErrTooManyToDiscard = -10,
+    NimbleStepErrMalformedStep = -11,
+    NimbleStepErrRangeHashDisabled = -12,
+    NimbleStepErrNotRetained = -13,
+    NimbleStepErrNoFreeCursor = -14,
+    NimbleStepErrMissingDeltaReference = -15,
+    NimbleStepErrTooFarAhead = -16,
+    NimbleStepErrTooOld = -17,
+    NimbleStepErrNotComposing = -18,
+    NimbleStepErrInvalidParticipant = -19,
+    NimbleStepErrTooManyParticipants = -20,
+    NimbleStepErrNoFreeSlot = -21,
+    NimbleStepErrNotInUse = -22,
+    NimbleStepErrNotOpen = -23,
+    NimbleStepErrNotSupported = -24,
+    NimbleStepErrFileSystem = -25,
+    NimbleStepErrCorrupt = -26,
+    NimbleStepErrWindowSize = -27,
+} NimbleStepErr;
 
 #endif
@@ -0,0 +1,68 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_BIT_SCAN_H
+#define NIMBLE_STEPS_BIT_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined _MSC_VER
+#include <intrin.h>
+#endif
+
+/// Number of zero bits above the highest set bit. value must not be zero.
+static inline size_t nbsCountLeadingZeros64(uint64_t value)
+{
+#if defined _MSC_VER && (defined _M_X64 || defined _M_ARM64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return 63u - index;
+#elif defined _MSC_VER
+    unsigned long index;
+    if (_BitScanReverse(&index, (unsigned long) (value >> 32))) {
+        return 31u - index;
+    }
+    _BitScanReverse(&index, (unsigned long) value);
+    return 63u - index;
+#else
+    return (size_t) __builtin_clzll(value);
+#endif
+}
+
+/// Number of zero bits below the lowest set bit. value must not be zero.
+static inline size_t nbsCountTrailingZeros64(uint64_t value)
+{
+#if defined _MSC_VER && (defined _M_X64 || defined _M_ARM64)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return index;
+#elif defined _MSC_VER
+    unsigned long index;
+    if (_BitScanForward(&index, (unsigned long) value)) {
+        return index;
+    }
+    _BitScanForward(&index, (unsigned long) (value >> 32));
+    return 32u + index;
+#else
+    return (size_t) __builtin_ctzll(value);
+#endif
+}
+
+/// Number of set bits
+static inline size_t nbsPopCount64(uint64_t value)
+{
+#if defined _MSC_VER && defined _M_X64
+    return (size_t) __popcnt64(value);
+#elif defined _MSC_VER
+    value = value - ((value >> 1) & 0x5555555555555555ull);
+    value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+    value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (size_t) ((value * 0x0101010101010101ull) >> 56);
+#else
+    return (size_t) __builtin_popcountll(value);
+#endif
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include <nimble-steps/buffering.h>
+#include <nimble-steps/steps.h>
+
+// Number of updates in a row that must ask for a lower depth before the target depth is lowered by one
+#define NBS_STEPS_BUFFERING_LOWER_AFTER_UPDATE_COUNT (60)
+#define NBS_STEPS_BUFFERING_PERMILLE_PER_STEP (20)
+#define NBS_STEPS_BUFFERING_MAX_PERMILLE (100)
+#define NBS_STEPS_BUFFERING_MAX_DEVIATION_SCALED ((int64_t) 1 << 30)
+
+static uint64_t nbsStepsBufferingSquareRoot(uint64_t value)
+{
+    uint64_t result = 0;
+    uint64_t bit = (uint64_t) 1 << 62;
+
+    while (bit > value) {
+        bit >>= 2;
+    }
+
+    while (bit != 0) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return result;
+}
+
+/// Initializes the buffering policy
+/// @param self buffering
+/// @param tickInterval the expected time between two steps, in the same unit as the step times
+/// @param minDepth the lowest target depth
+/// @param maxDepth the highest target depth
+void nbsStepsBufferingInit(NbsStepsBuffering* self, uint64_t tickInterval, size_t minDepth, size_t maxDepth)
+{
+    tc_mem_clear_type(self);
+    self->tickInterval = tickInterval > 0 ? tickInterval : 1;
+    self->minDepth = minDepth > 0 ? minDepth : 1;
+    self->maxDepth = maxDepth > self->minDepth ? maxDepth : self->minDepth;
+    self->targetDepth = self->minDepth;
+    self->meanIntervalScaled = (int64_t) (self->tickInterval * 16);
+}
+
+static void nbsStepsBufferingAddInterval(NbsStepsBuffering* self, uint64_t interval)
+{
+    int64_t deviationScaled = (int64_t) (interval * 16) - self->meanIntervalScaled;
+    if (deviationScaled > NBS_STEPS_BUFFERING_MAX_DEVIATION_SCALED) {
+        deviationScaled = NBS_STEPS_BUFFERING_MAX_DEVIATION_SCALED;
+    } else if (deviationScaled < -NBS_STEPS_BUFFERING_MAX_DEVIATION_SCALED) {
+        deviationScaled = -NBS_STEPS_BUFFERING_MAX_DEVIATION_SCALED;
+    }
+
+    self->meanIntervalScaled += deviationScaled / 16;
+    self->varianceScaled += (deviationScaled * deviationScaled / 16 - self->varianceScaled) / 16;
+    self->sampleCount++;
+}
+
+/// Returns the standard deviation of the time between steps
+/// @param self buffering
+/// @return the jitter, in the same unit as the step times
+uint64_t nbsStepsBufferingJitter(const NbsStepsBuffering* self)
+{
+    return nbsStepsBufferingSquareRoot((uint64_t) self->varianceScaled / 16);
+}
+
+static size_t nbsStepsBufferingDesiredDepth(const NbsStepsBuffering* self)
+{
+    // Cover three standard deviations of jitter, plus the step that is about to be read
+    uint64_t jitter = nbsStepsBufferingJitter(self);
+    return 1 + (size_t) ((3 * jitter + self->tickInterval - 1) / self->tickInterval);
+}
+
+/// Feeds the times of the newly written steps to the policy, updates the target depth of the steps buffer and
+/// advises how the consumer should adjust its tick rate.
+/// Call it once for each tick, before reading from the buffer. The steps should be written with nbsStepsWriteWithTime.
+/// @param self buffering
+/// @param steps the steps buffer
+/// @return advice for the consumer
+NbsStepsBufferingAdvice nbsStepsBufferingUpdate(NbsStepsBuffering* self, struct NbsSteps* steps)
+{
+    StepId firstNewId = self->hasLastSeenTime ? self->lastSeenWriteId : steps->expectedReadId;
+    if (firstNewId < steps->expectedReadId) {
+        firstNewId = steps->expectedReadId;
+    }
+
+    for (StepId id = firstNewId; id < steps->expectedWriteId; ++id) {
+        uint64_t time;
+        if (nbsStepsTimeForStep(steps, id, &time) < 0) {
+            continue;
+        }
+        if (self->hasLastSeenTime && time >= self->lastSeenTime) {
+            nbsStepsBufferingAddInterval(self, time - self->lastSeenTime);
+        }
+        self->lastSeenTime = time;
+        self->hasLastSeenTime = true;
+    }
+    self->lastSeenWriteId = steps->expectedWriteId;
+    nbsStepsStatsSampleDepth(steps);
+
+    size_t desiredDepth = nbsStepsBufferingDesiredDepth(self);
+
+    // The consumer found the buffer empty, which is a stronger signal than the jitter estimate
+    if (steps->stepsCount == 0) {
+        steps->waitCounter++;
+        if (desiredDepth <= self->targetDepth) {
+            desiredDepth = self->targetDepth + 1;
+        }
+    } else {
+        steps->waitCounter = 0;
+    }
+
+    if (desiredDepth > self->targetDepth) {
+        self->targetDepth = desiredDepth;
+        self->lowerTargetCount = 0;
+    } else if (desiredDepth < self->targetDepth) {
+        self->lowerTargetCount++;
+        if (self->lowerTargetCount >= NBS_STEPS_BUFFERING_LOWER_AFTER_UPDATE_COUNT) {
+            self->targetDepth--;
+            self->lowerTargetCount = 0;
+        }
+    } else {
+        self->lowerTargetCount = 0;
+    }
+
+    if (self->targetDepth < self->minDepth) {
+        self->targetDepth = self->minDepth;
+    } else if (self->targetDepth > self->maxDepth) {
+        self->targetDepth = self->maxDepth;
+    }
+
+    nbsStepsSetTargetDepth(steps, self->targetDepth);
+
+    NbsStepsBufferingAdvice advice;
+    advice.targetDepth = self->targetDepth;
+    advice.action = NbsStepsBufferingActionKeep;
+    advice.tickRateAdjustmentPermille = 0;
+
+    // Allow one step above the target before catching up, so the rate does not flip every tick
+    int depthDifference = (int) steps->stepsCount - (int) self->targetDepth;
+    if (depthDifference > 1) {
+        advice.action = NbsStepsBufferingActionCatchUp;
+        advice.tickRateAdjustmentPermille = (depthDifference - 1) * NBS_STEPS_BUFFERING_PERMILLE_PER_STEP;
+    } else if (depthDifference < 0) {
+        advice.action = NbsStepsBufferingActionSlowDown;
+        advice.tickRateAdjustmentPermille = depthDifference * NBS_STEPS_BUFFERING_PERMILLE_PER_STEP;
+    }
+
+    if (advice.tickRateAdjustmentPermille > NBS_STEPS_BUFFERING_MAX_PERMILLE) {
+        advice.tickRateAdjustmentPermille = NBS_STEPS_BUFFERING_MAX_PERMILLE;
+    } else if (advice.tickRateAdjustmentPermille < -NBS_STEPS_BUFFERING_MAX_PERMILLE) {
+        advice.tickRateAdjustmentPermille = -NBS_STEPS_BUFFERING_MAX_PERMILLE;
+    }
+
+    return advice;
+}
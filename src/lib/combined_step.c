@@ -0,0 +1,115 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include "nbs_log.h"
+#include <clog/clog.h>
+#include <nimble-steps/combined_step.h>
+#include <nimble-steps/steps.h>
+
+/// Reserves room for a combined step directly in the steps buffer
+/// The step is not visible to readers until nbsCombinedStepComposerCommit is called. No other step can be written to
+/// the buffer while composing.
+/// @param self composer
+/// @param steps steps buffer to write the combined step to
+/// @param stepId must be the expectedWriteId of steps
+/// @return negative on error
+int nbsCombinedStepComposerBegin(NbsCombinedStepComposer* self, struct NbsSteps* steps, StepId stepId)
+{
+    size_t maxOctetCount = steps->maxStepOctetCount;
+    if (maxOctetCount > NimbleStepMaxCombinedStepOctetCount) {
+        maxOctetCount = NimbleStepMaxCombinedStepOctetCount;
+    }
+
+    int errorCode = nbsStepsWriteReserve(steps, stepId, maxOctetCount, &self->payload);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    self->steps = steps;
+    self->maxOctetCount = maxOctetCount;
+    self->octetCount = 1; // participant count is written on commit
+    self->participantCount = 0;
+    self->participantIdMask = 0;
+    self->isComposing = true;
+
+    return 0;
+}
+
+/// Writes the input for one participant into the combined step
+/// @param self composer
+/// @param participantId participant id, each participant can only be added once
+/// @param input the application specific input for the participant
+/// @param octetCount number of octets in input
+/// @return negative on error
+int nbsCombinedStepComposerAdd(NbsCombinedStepComposer* self, uint8_t participantId, const uint8_t* input,
+                               size_t octetCount)
+{
+    if (!self->isComposing) {
+        return NimbleStepErrNotComposing;
+    }
+
+    if (participantId > NimbleStepMaxParticipantIdValue) {
+        NBS_LOG_C_SOFT_ERROR(&self->steps->log, "participant id %d is too high", participantId)
+        return NimbleStepErrInvalidParticipant;
+    }
+
+    uint64_t participantBit = (uint64_t) 1 << participantId;
+    if (self->participantIdMask & participantBit) {
+        NBS_LOG_C_SOFT_ERROR(&self->steps->log, "participant id %d is already in the combined step", participantId)
+        return NimbleStepErrInvalidParticipant;
+    }
+
+    if (self->participantCount == NimbleStepMaxParticipantCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->steps->log, "combined step already has %zu participants", self->participantCount)
+        return NimbleStepErrTooManyParticipants;
+    }
+
+    if (octetCount > NimbleStepMaxSingleStepOctetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->steps->log, "participant input of %zu octets is too big", octetCount)
+        return NimbleStepErrWrongOctetCount;
+    }
+
+    if (self->octetCount + 2 + octetCount > self->maxOctetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->steps->log, "combined step is full, can not add %zu octets", octetCount)
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    uint8_t* target = self->payload + self->octetCount;
+    target[0] = participantId;
+    target[1] = (uint8_t) octetCount;
+    tc_memcpy_octets(target + 2, input, octetCount);
+
+    self->octetCount += 2 + octetCount;
+    self->participantCount++;
+    self->participantIdMask |= participantBit;
+
+    return 0;
+}
+
+/// Adds the combined step to the steps buffer
+/// @param self composer
+/// @return octet count of the combined step, or negative on error
+int nbsCombinedStepComposerCommit(NbsCombinedStepComposer* self)
+{
+    if (!self->isComposing) {
+        return NimbleStepErrNotComposing;
+    }
+
+    self->payload[0] = (uint8_t) self->participantCount;
+    self->isComposing = false;
+
+    return nbsStepsWriteCommit(self->steps, self->octetCount);
+}
+
+/// Drops the combined step that is being composed
+/// @param self composer
+void nbsCombinedStepComposerCancel(NbsCombinedStepComposer* self)
+{
+    if (!self->isComposing) {
+        return;
+    }
+
+    nbsStepsWriteCancel(self->steps);
+    self->isComposing = false;
+}
@@ -0,0 +1,257 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include <clog/clog.h>
+#include <flood/out_stream.h>
+#include <imprint/allocator.h>
+#include <nimble-steps/fan_out.h>
+#include <nimble-steps/pending_steps.h>
+#include <nimble-steps/redundant_steps.h>
+#include <nimble-steps/steps.h>
+
+#define NBS_STEPS_FAN_OUT_RANGE_HEADER_OCTET_COUNT (5)
+#define NBS_STEPS_FAN_OUT_STEP_HEADER_OCTET_COUNT (2)
+
+/// Initializes the fan-out and allocates the serialized steps and the subscriber table
+/// The serialized steps are kept in a ring that has room for everything the steps buffer can hold, so a step is
+/// never overwritten while it is still in the steps buffer.
+/// @param self fan-out
+/// @param allocator allocator to use
+/// @param steps the authoritative steps to send, must outlive the fan-out
+/// @param subscriberCount maximum number of subscribers
+/// @param log the log to use
+void nbsStepsFanOutInit(NbsStepsFanOut* self, struct ImprintAllocator* allocator, const struct NbsSteps* steps,
+                        size_t subscriberCount, Clog log)
+{
+    tc_mem_clear_type(self);
+    self->log = log;
+    self->steps = steps;
+    self->serializedCapacity = steps->stepsData.capacity +
+                               (steps->windowSize / 2) * NBS_STEPS_FAN_OUT_STEP_HEADER_OCTET_COUNT +
+                               NBS_STEPS_FAN_OUT_STEP_HEADER_OCTET_COUNT + steps->maxStepOctetCount;
+    if (self->serializedCapacity > UINT32_MAX) {
+        CLOG_C_ERROR(&self->log, "nbsStepsFanOutInit: %zu serialized octets is too big", self->serializedCapacity)
+    }
+    self->serialized = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, self->serializedCapacity);
+    self->serializedOffsets = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint32_t, steps->windowSize);
+    self->serializedUpToId = steps->expectedReadId;
+    nimbleStepsReceiveMaskTableInit(&self->subscribers, allocator, subscriberCount, steps->expectedReadId);
+}
+
+/// Serializes the steps that have been written to the steps buffer since the last update
+/// Call it once each tick, before the datagrams are created.
+/// @param self fan-out
+/// @return number of steps serialized
+size_t nbsStepsFanOutUpdate(NbsStepsFanOut* self)
+{
+    const NbsSteps* steps = self->steps;
+    StepId stepId = self->serializedUpToId;
+
+    // Steps that were discarded before they were serialized are never sent
+    if ((StepId) (stepId - steps->expectedReadId) > steps->stepsCount) {
+        stepId = steps->expectedReadId;
+    }
+
+    size_t serializedCount = 0;
+    if (stepId != steps->expectedWriteId) {
+        int infoIndex = nbsStepsGetIndexForStep(steps, stepId);
+        for (; stepId != steps->expectedWriteId; ++stepId) {
+            NbsStepView view;
+            int octetCount = nbsStepsViewAtIndex(steps, infoIndex, &view);
+            size_t serializedOctetCount = NBS_STEPS_FAN_OUT_STEP_HEADER_OCTET_COUNT + (size_t) octetCount;
+
+            // A serialized step is never split, so that consecutive steps are one slice until the ring wraps
+            if (self->writeOffset + serializedOctetCount > self->serializedCapacity) {
+                self->wrapEndOffset = self->writeOffset;
+                self->writeOffset = 0;
+            }
+
+            FldOutStream stream;
+            fldOutStreamInit(&stream, self->serialized + self->writeOffset, serializedOctetCount);
+            fldOutStreamWriteUInt16(&stream, (uint16_t) octetCount);
+            fldOutStreamWriteOctets(&stream, view.first.payload, view.first.octetCount);
+            if (view.second.octetCount > 0) {
+                fldOutStreamWriteOctets(&stream, view.second.payload, view.second.octetCount);
+            }
+
+            self->serializedOffsets[infoIndex] = (uint32_t) self->writeOffset;
+            self->writeOffset += serializedOctetCount;
+            infoIndex = (size_t) infoIndex + 1 == steps->windowSize ? 0 : infoIndex + 1;
+            serializedCount++;
+        }
+    }
+
+    self->serializedUpToId = stepId;
+
+    return serializedCount;
+}
+
+/// Sets the position for a subscriber, for example when it connects. All steps before expectingId count as received.
+/// @param self fan-out
+/// @param subscriberIndex index in the subscriber table
+/// @param expectingId the first step to send to the subscriber
+void nbsStepsFanOutResetSubscriber(NbsStepsFanOut* self, size_t subscriberIndex, StepId expectingId)
+{
+    nimbleStepsReceiveMaskTableReset(&self->subscribers, subscriberIndex, expectingId);
+}
+
+/// Updates the position of a subscriber from the receive mask it reported
+/// Acks that are older than the last one, for example from a reordered datagram, are ignored.
+/// @param self fan-out
+/// @param subscriberIndex index in the subscriber table
+/// @param receiveMask the receive mask reported by the subscriber
+void nbsStepsFanOutAck(NbsStepsFanOut* self, size_t subscriberIndex, const NimbleStepsReceiveMask* receiveMask)
+{
+    // Compare the distance instead of the ids, so it also works when the StepId wraps around
+    StepId previousExpectingWriteId = self->subscribers.expectingWriteIds[subscriberIndex];
+    if ((int32_t) (receiveMask->expectingWriteId - previousExpectingWriteId) < 0) {
+        return;
+    }
+
+    self->subscribers.expectingWriteIds[subscriberIndex] = receiveMask->expectingWriteId;
+    self->subscribers.receiveMasks[subscriberIndex] = receiveMask->receiveMask;
+}
+
+static void nbsStepsFanOutAddSlice(NbsStepsFanOutDatagram* datagram, const uint8_t* octets, size_t octetCount)
+{
+    NbsStepsFanOutSlice* slice = &datagram->slices[datagram->sliceCount++];
+    slice->octets = octets;
+    slice->octetCount = octetCount;
+}
+
+/// Adds the serialized steps from firstIndex to lastIndex, as one slice or as two if the serialized ring wrapped
+static void nbsStepsFanOutAddStepSlices(const NbsStepsFanOut* self, size_t firstIndex, size_t lastIndex,
+                                        NbsStepsFanOutDatagram* datagram)
+{
+    size_t startOffset = self->serializedOffsets[firstIndex];
+    size_t endOffset = self->serializedOffsets[lastIndex] + NBS_STEPS_FAN_OUT_STEP_HEADER_OCTET_COUNT +
+                       self->steps->infos[lastIndex].octetCount;
+    if (endOffset > startOffset) {
+        nbsStepsFanOutAddSlice(datagram, self->serialized + startOffset, endOffset - startOffset);
+        return;
+    }
+
+    nbsStepsFanOutAddSlice(datagram, self->serialized + startOffset, self->wrapEndOffset - startOffset);
+    nbsStepsFanOutAddSlice(datagram, self->serialized, endOffset);
+}
+
+/// Creates the datagram payload with the steps that a subscriber has not acknowledged, oldest first
+/// The payload is identical to what nbsRedundantStepsWrite writes for the same receive mask, except that at most
+/// NBS_STEPS_FAN_OUT_MAX_RANGE_COUNT ranges are included. Only steps serialized by nbsStepsFanOutUpdate are sent.
+/// @param self fan-out
+/// @param subscriberIndex index in the subscriber table
+/// @param maxOctetCount maximum number of octets in the datagram payload
+/// @param datagram the datagram to fill out
+/// @return number of steps in the datagram or negative on error
+int nbsStepsFanOutDatagram(const NbsStepsFanOut* self, size_t subscriberIndex, size_t maxOctetCount,
+                           NbsStepsFanOutDatagram* datagram)
+{
+    const NbsSteps* steps = self->steps;
+
+    datagram->sliceCount = 0;
+    datagram->octetCount = 0;
+    if (maxOctetCount < 1) {
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    StepId headId = self->subscribers.expectingWriteIds[subscriberIndex];
+    NbsPendingRange ranges[64 / 2 + 1];
+    int rangeCount = nbsPendingStepsRanges(headId, self->serializedUpToId - 1,
+                                           self->subscribers.receiveMasks[subscriberIndex], ranges, 64 / 2, 64);
+
+    // The steps from the head of the receive mask and onward have not been received at all
+    if (self->serializedUpToId > headId) {
+        ranges[rangeCount].startId = headId;
+        ranges[rangeCount].count = self->serializedUpToId - headId;
+        rangeCount++;
+    }
+
+    FldOutStream headerStream;
+    fldOutStreamInit(&headerStream, datagram->headers, sizeof(datagram->headers));
+    fldOutStreamWriteUInt8(&headerStream, 0);
+    size_t headerSliceStart = 0;
+    size_t octetCount = 1;
+    size_t writtenRangeCount = 0;
+    size_t writtenStepCount = 0;
+    bool hasRoomLeft = true;
+
+    for (int i = 0; i < rangeCount && hasRoomLeft; ++i) {
+        StepId startId = ranges[i].startId;
+        StepId endId = startId + (StepId) ranges[i].count;
+        if (startId < steps->expectedReadId) {
+            startId = steps->expectedReadId;
+        }
+        if (endId > self->serializedUpToId) {
+            endId = self->serializedUpToId;
+        }
+        if (startId >= endId || steps->stepsCount == 0) {
+            continue;
+        }
+
+        if (writtenRangeCount + (endId - startId) / NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT + 1 > UINT8_MAX) {
+            break;
+        }
+
+        // The steps are stored in order, so only the first step needs an index lookup
+        int infoIndex = nbsStepsGetIndexForStep(steps, startId);
+        if (infoIndex < 0) {
+            continue;
+        }
+
+        size_t count = endId - startId;
+        while (count > 0) {
+            if (writtenRangeCount == NBS_STEPS_FAN_OUT_MAX_RANGE_COUNT ||
+                octetCount + NBS_STEPS_FAN_OUT_RANGE_HEADER_OCTET_COUNT + NBS_STEPS_FAN_OUT_STEP_HEADER_OCTET_COUNT +
+                        steps->infos[infoIndex].octetCount >
+                    maxOctetCount) {
+                hasRoomLeft = false;
+                break;
+            }
+
+            size_t chunkCount = count < NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT
+                                    ? count
+                                    : NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT;
+            size_t firstIndex = (size_t) infoIndex;
+            size_t lastIndex = firstIndex;
+            size_t stepsOctetCount = 0;
+            size_t writtenCount = 0;
+            for (; writtenCount < chunkCount; ++writtenCount) {
+                size_t serializedOctetCount = NBS_STEPS_FAN_OUT_STEP_HEADER_OCTET_COUNT +
+                                              steps->infos[infoIndex].octetCount;
+                if (octetCount + NBS_STEPS_FAN_OUT_RANGE_HEADER_OCTET_COUNT + stepsOctetCount + serializedOctetCount >
+                    maxOctetCount) {
+                    break;
+                }
+                stepsOctetCount += serializedOctetCount;
+                lastIndex = (size_t) infoIndex;
+                infoIndex = (size_t) infoIndex + 1 == steps->windowSize ? 0 : infoIndex + 1;
+            }
+
+            fldOutStreamWriteUInt32(&headerStream, startId);
+            fldOutStreamWriteUInt8(&headerStream, (uint8_t) writtenCount);
+            nbsStepsFanOutAddSlice(datagram, datagram->headers + headerSliceStart, headerStream.pos - headerSliceStart);
+            headerSliceStart = headerStream.pos;
+            nbsStepsFanOutAddStepSlices(self, firstIndex, lastIndex, datagram);
+
+            octetCount += NBS_STEPS_FAN_OUT_RANGE_HEADER_OCTET_COUNT + stepsOctetCount;
+            writtenRangeCount++;
+            writtenStepCount += writtenCount;
+            if (writtenCount < chunkCount) {
+                hasRoomLeft = false;
+                break;
+            }
+
+            startId += (StepId) writtenCount;
+            count -= writtenCount;
+        }
+    }
+
+    datagram->headers[0] = (uint8_t) writtenRangeCount;
+    if (writtenRangeCount == 0) {
+        nbsStepsFanOutAddSlice(datagram, datagram->headers, 1);
+    }
+    datagram->octetCount = octetCount;
+
+    return (int) writtenStepCount;
+}
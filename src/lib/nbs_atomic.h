@@ -0,0 +1,74 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_ATOMIC_H
+#define NIMBLE_STEPS_ATOMIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C99 has no <stdatomic.h>, so use the compiler intrinsics directly
+
+#if defined _MSC_VER
+#include <intrin.h>
+
+#if defined _M_ARM64
+#define NBS_ATOMIC_BARRIER() __dmb(_ARM64_BARRIER_ISH)
+#elif defined _M_ARM
+#define NBS_ATOMIC_BARRIER() __dmb(_ARM_BARRIER_ISH)
+#else
+#define NBS_ATOMIC_BARRIER() _ReadWriteBarrier()
+#endif
+
+static inline size_t nbsAtomicLoadAcquire(const size_t* target)
+{
+    size_t value = *(const volatile size_t*) target;
+    NBS_ATOMIC_BARRIER();
+    return value;
+}
+
+static inline void nbsAtomicStoreRelease(size_t* target, size_t value)
+{
+    NBS_ATOMIC_BARRIER();
+    *(volatile size_t*) target = value;
+}
+
+static inline uint32_t nbsAtomicLoadAcquireU32(const uint32_t* target)
+{
+    uint32_t value = *(const volatile uint32_t*) target;
+    NBS_ATOMIC_BARRIER();
+    return value;
+}
+
+static inline void nbsAtomicStoreReleaseU32(uint32_t* target, uint32_t value)
+{
+    NBS_ATOMIC_BARRIER();
+    *(volatile uint32_t*) target = value;
+}
+
+#else
+
+static inline size_t nbsAtomicLoadAcquire(const size_t* target)
+{
+    return __atomic_load_n(target, __ATOMIC_ACQUIRE);
+}
+
+static inline void nbsAtomicStoreRelease(size_t* target, size_t value)
+{
+    __atomic_store_n(target, value, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t nbsAtomicLoadAcquireU32(const uint32_t* target)
+{
+    return __atomic_load_n(target, __ATOMIC_ACQUIRE);
+}
+
+static inline void nbsAtomicStoreReleaseU32(uint32_t* target, uint32_t value)
+{
+    __atomic_store_n(target, value, __ATOMIC_RELEASE);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,23 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#ifndef NIMBLE_STEPS_NBS_LOG_H
+#define NIMBLE_STEPS_NBS_LOG_H
+
+#include <clog/clog.h>
+
+/// Logging used on the read and write paths.
+/// Define NIMBLE_STEPS_NO_LOGGING to remove the calls, including the argument formatting, so that bad input
+/// from a peer only costs the returned error code. Fatal errors during init still use clog directly.
+#if defined NIMBLE_STEPS_NO_LOGGING
+#define NBS_LOG_C_VERBOSE(logger, ...)
+#define NBS_LOG_C_WARN(logger, ...)
+#define NBS_LOG_C_SOFT_ERROR(logger, ...)
+#else
+#define NBS_LOG_C_VERBOSE(logger, ...) CLOG_C_VERBOSE(logger, __VA_ARGS__)
+#define NBS_LOG_C_WARN(logger, ...) CLOG_C_WARN(logger, __VA_ARGS__)
+#define NBS_LOG_C_SOFT_ERROR(logger, ...) CLOG_C_SOFT_ERROR(logger, __VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,358 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include "bit_scan.h"
+#include "nbs_log.h"
+#include <clog/clog.h>
+#include <imprint/allocator.h>
+#include <nimble-steps/pending_steps.h>
+#include <nimble-steps/steps.h>
+
+static size_t nbsPendingStepsSlot(const NbsPendingSteps* self, StepId stepId)
+{
+    return stepId & (self->windowSize - 1);
+}
+
+/// Initializes the pending steps and allocates the payload storage for the whole window
+/// @param self pending steps
+/// @param lateJoinStepId the first stepId that is expected
+/// @param allocator allocator to use for the payload storage
+/// @param maxOctetCountPerStep maximum octet count for a single step
+/// @param log the log to use
+void nbsPendingStepsInit(NbsPendingSteps* self, StepId lateJoinStepId, struct ImprintAllocator* allocator,
+                         size_t maxOctetCountPerStep, Clog log)
+{
+    nbsPendingStepsInitWithWindowSize(self, lateJoinStepId, allocator, maxOctetCountPerStep,
+                                      NBS_PENDING_STEPS_WINDOW_SIZE, log);
+}
+
+/// Initializes the pending steps with a specific window size and allocates the payload storage for the whole window
+/// @param self pending steps
+/// @param lateJoinStepId the first stepId that is expected
+/// @param allocator allocator to use for the payload storage
+/// @param maxOctetCountPerStep maximum octet count for a single step
+/// @param windowSize 64, 128 or 256 steps
+/// @param log the log to use
+void nbsPendingStepsInitWithWindowSize(NbsPendingSteps* self, StepId lateJoinStepId, struct ImprintAllocator* allocator,
+                                       size_t maxOctetCountPerStep, size_t windowSize, Clog log)
+{
+    tc_mem_clear_type(self);
+    self->log = log;
+
+    if (windowSize != 64 && windowSize != 128 && windowSize != NBS_PENDING_STEPS_MAX_WINDOW_SIZE) {
+        CLOG_C_ERROR(&self->log, "pending steps window size must be 64, 128 or 256, but encountered %zu", windowSize)
+    }
+
+    self->windowSize = windowSize;
+    self->maxOctetCountPerStep = maxOctetCountPerStep;
+    self->steps = IMPRINT_ALLOC_TYPE_COUNT(allocator, NbsPendingStep, windowSize);
+    self->payloads = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, maxOctetCountPerStep * windowSize);
+    nbsPendingStepsReset(self, lateJoinStepId);
+}
+
+/// Clears all pending steps and sets a new expected StepId
+/// @param self pending steps
+/// @param lateJoinStepId the first stepId that is expected
+void nbsPendingStepsReset(NbsPendingSteps* self, StepId lateJoinStepId)
+{
+    for (size_t i = 0; i < self->windowSize; ++i) {
+        self->steps[i].isInUse = false;
+        self->steps[i].octetCount = 0;
+    }
+    self->expectingReadId = lateJoinStepId;
+    self->storedCount = 0;
+    nimbleStepsReceiveMaskWideInit(&self->receiveMask, lateJoinStepId, self->windowSize);
+}
+
+/// Stores a step that was received in any order
+/// @param self pending steps
+/// @param stepId the stepId of the received step
+/// @param payload the step payload
+/// @param octetCount number of octets in payload
+/// @return 1 if the step was stored, 0 if it was already received, negative on error.
+int nbsPendingStepsTrySet(NbsPendingSteps* self, StepId stepId, const uint8_t* payload, size_t octetCount)
+{
+    if (stepId < self->expectingReadId) {
+        return 0;
+    }
+
+    StepId distance = stepId - self->expectingReadId;
+    if (distance >= self->windowSize) {
+        NBS_LOG_C_VERBOSE(&self->log, "pending step %08X is too far in the future, expecting %08X", stepId,
+                          self->expectingReadId)
+        return NimbleStepErrTooFarAhead;
+    }
+
+    if (octetCount < NimbleStepMinimumSingleStepOctetCount || octetCount > self->maxOctetCountPerStep) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "pending step %08X has wrong octet count %zu", stepId, octetCount)
+        return NimbleStepErrWrongOctetCount;
+    }
+
+    size_t slot = nbsPendingStepsSlot(self, stepId);
+    NbsPendingStep* step = &self->steps[slot];
+    if (step->isInUse) {
+        return 0;
+    }
+
+    tc_memcpy_octets(self->payloads + slot * self->maxOctetCountPerStep, payload, octetCount);
+    step->octetCount = octetCount;
+    step->idForDebug = stepId;
+    step->isInUse = true;
+    self->storedCount++;
+
+    nimbleStepsReceiveMaskWideReceivedStep(&self->receiveMask, stepId);
+
+    return 1;
+}
+
+/// Checks if the next expected step has been received
+/// @param self pending steps
+/// @return true if nbsPendingStepsTryRead will return a step
+bool nbsPendingStepsCanBeAdvanced(const NbsPendingSteps* self)
+{
+    return self->steps[nbsPendingStepsSlot(self, self->expectingReadId)].isInUse;
+}
+
+static void nbsPendingStepsConsume(NbsPendingSteps* self, NbsPendingStep* step)
+{
+    step->isInUse = false;
+    self->storedCount--;
+    self->expectingReadId++;
+}
+
+/// Reads the next step in order, if it has been received
+/// The payload points into the pending steps storage and is valid until the next nbsPendingStepsTrySet.
+/// @param self pending steps
+/// @param outPayload set to the step payload
+/// @param outOctetCount set to the octet count of the step
+/// @param outStepId set to the stepId of the step
+/// @return 1 if a step was read, 0 if the next step has not been received yet
+int nbsPendingStepsTryRead(NbsPendingSteps* self, const uint8_t** outPayload, size_t* outOctetCount,
+                           StepId* outStepId)
+{
+    size_t slot = nbsPendingStepsSlot(self, self->expectingReadId);
+    NbsPendingStep* step = &self->steps[slot];
+    if (!step->isInUse) {
+        return 0;
+    }
+
+    *outPayload = self->payloads + slot * self->maxOctetCountPerStep;
+    *outOctetCount = step->octetCount;
+    *outStepId = self->expectingReadId;
+
+    nbsPendingStepsConsume(self, step);
+
+    return 1;
+}
+
+/// Moves all steps that are in order to the target steps buffer
+/// Steps that the target already has are dropped. A step is only removed from the pending steps when it has been
+/// written, so the steps that do not fit are kept until the next copy.
+/// @param self pending steps
+/// @param target the steps buffer to write to
+/// @return number of steps moved, or negative on error
+int nbsPendingStepsCopy(NbsPendingSteps* self, struct NbsSteps* target)
+{
+    if (self->expectingReadId < target->expectedWriteId) {
+        StepId skipCount = target->expectedWriteId - self->expectingReadId;
+        if (skipCount > self->windowSize) {
+            skipCount = (StepId) self->windowSize;
+        }
+        for (StepId i = 0; i < skipCount; ++i) {
+            NbsPendingStep* step = &self->steps[nbsPendingStepsSlot(self, self->expectingReadId + i)];
+            if (step->isInUse) {
+                step->isInUse = false;
+                self->storedCount--;
+            }
+        }
+        self->expectingReadId = target->expectedWriteId;
+    }
+
+    if (self->expectingReadId != target->expectedWriteId) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "pending steps can not be copied, expecting %08X but target expects %08X",
+                             self->expectingReadId, target->expectedWriteId)
+        return NimbleStepErrWrongStepId;
+    }
+
+    int copiedCount = 0;
+    while (true) {
+        size_t slot = nbsPendingStepsSlot(self, self->expectingReadId);
+        NbsPendingStep* step = &self->steps[slot];
+        if (!step->isInUse || !nbsStepsHasRoomFor(target, step->octetCount)) {
+            break;
+        }
+        int errorCode = nbsStepsWrite(target, self->expectingReadId, self->payloads + slot * self->maxOctetCountPerStep,
+                                      step->octetCount);
+        if (errorCode < 0) {
+            return errorCode;
+        }
+        nbsPendingStepsConsume(self, step);
+        copiedCount++;
+    }
+
+    return copiedCount;
+}
+
+/// Gets the 64 most recent bits of the receive mask to send back to the sender
+/// @param self pending steps
+/// @param headId set to the stepId that bit zero in the mask is relative to (bit zero is headId - 1)
+/// @return the receive mask
+NimbleStepsReceiveMaskBits nbsPendingStepsReceiveMask(const NbsPendingSteps* self, StepId* headId)
+{
+    *headId = self->receiveMask.expectingWriteId;
+    return self->receiveMask.words[0];
+}
+
+/// Gets the receive mask that covers the whole pending window
+/// @param self pending steps
+/// @return the wide receive mask
+const NimbleStepsReceiveMaskWide* nbsPendingStepsReceiveMaskWide(const NbsPendingSteps* self)
+{
+    return &self->receiveMask;
+}
+
+static int nbsPendingStepsRangesFromWords(StepId headId, StepId lastAvailableId,
+                                          const NimbleStepsReceiveMaskBits* words, size_t wordCount,
+                                          NbsPendingRange* ranges, size_t maxRangeCount, size_t maxStepCount)
+{
+    // Bit index zero is headId - 1, a higher bit index is an older step
+    size_t bitCount = wordCount * 64;
+    if (headId < bitCount) {
+        bitCount = headId;
+    }
+
+    size_t lowestBitIndex = 0;
+    if (lastAvailableId < headId - 1) {
+        lowestBitIndex = headId - 1 - lastAvailableId;
+    }
+
+    size_t rangeCount = 0;
+    size_t stepCount = 0;
+
+    for (size_t w = wordCount; w-- > 0;) {
+        size_t wordStartBitIndex = w * 64;
+        if (wordStartBitIndex >= bitCount || wordStartBitIndex + 64 <= lowestBitIndex) {
+            continue;
+        }
+
+        NimbleStepsReceiveMaskBits missing = ~words[w];
+        if (bitCount - wordStartBitIndex < 64) {
+            missing &= ((NimbleStepsReceiveMaskBits) 1 << (bitCount - wordStartBitIndex)) - 1;
+        }
+        if (lowestBitIndex > wordStartBitIndex) {
+            missing &= ~(((NimbleStepsReceiveMaskBits) 1 << (lowestBitIndex - wordStartBitIndex)) - 1);
+        }
+
+        while (missing != 0) {
+            // The highest missing bit is the oldest missing step, count the missing bits directly below it
+            size_t highestBit = 63 - nbsCountLeadingZeros64(missing);
+            NimbleStepsReceiveMaskBits receivedAligned = ~(missing << (63 - highestBit));
+            size_t runLength = receivedAligned == 0 ? highestBit + 1 : nbsCountLeadingZeros64(receivedAligned);
+            size_t lowestBit = highestBit + 1 - runLength;
+
+            if (runLength == 64) {
+                missing = 0;
+            } else {
+                missing &= ~((((NimbleStepsReceiveMaskBits) 1 << runLength) - 1) << lowestBit);
+            }
+
+            if (stepCount + runLength > maxStepCount) {
+                runLength = maxStepCount - stepCount;
+            }
+            if (runLength == 0) {
+                return (int) rangeCount;
+            }
+
+            StepId startId = headId - 1 - (StepId) (wordStartBitIndex + highestBit);
+            NbsPendingRange* previous = rangeCount > 0 ? &ranges[rangeCount - 1] : 0;
+            if (previous != 0 && previous->startId + (StepId) previous->count == startId) {
+                previous->count += runLength;
+            } else {
+                if (rangeCount == maxRangeCount) {
+                    return (int) rangeCount;
+                }
+                ranges[rangeCount].startId = startId;
+                ranges[rangeCount].count = runLength;
+                rangeCount++;
+            }
+            stepCount += runLength;
+        }
+    }
+
+    return (int) rangeCount;
+}
+
+/// Finds the ranges of steps that are missing according to a receive mask, oldest first
+/// Steps from headId and onward are not included, they are assumed to be sent anyway.
+/// @param headId the expectingWriteId of the receive mask
+/// @param lastAvailableId the latest stepId that the caller can provide
+/// @param mask the receive mask, bit zero is headId - 1
+/// @param ranges target ranges
+/// @param maxRangeCount maximum number of ranges to fill
+/// @param maxStepCount maximum total number of steps in the ranges
+/// @return number of ranges filled
+int nbsPendingStepsRanges(StepId headId, StepId lastAvailableId, NimbleStepsReceiveMaskBits mask,
+                          NbsPendingRange* ranges, size_t maxRangeCount, size_t maxStepCount)
+{
+    return nbsPendingStepsRangesFromWords(headId, lastAvailableId, &mask, 1, ranges, maxRangeCount, maxStepCount);
+}
+
+/// Finds the ranges of steps that are missing according to a wide receive mask, oldest first
+/// Steps from the mask expectingWriteId and onward are not included, they are assumed to be sent anyway.
+/// @param mask the wide receive mask
+/// @param lastAvailableId the latest stepId that the caller can provide
+/// @param ranges target ranges
+/// @param maxRangeCount maximum number of ranges to fill
+/// @param maxStepCount maximum total number of steps in the ranges
+/// @return number of ranges filled
+int nbsPendingStepsRangesWide(const NimbleStepsReceiveMaskWide* mask, StepId lastAvailableId, NbsPendingRange* ranges,
+                              size_t maxRangeCount, size_t maxStepCount)
+{
+    return nbsPendingStepsRangesFromWords(mask->expectingWriteId, lastAvailableId, mask->words, mask->wordCount,
+                                          ranges, maxRangeCount, maxStepCount);
+}
+
+/// Debug logging of ranges
+/// @param ranges the ranges
+/// @param debug description
+/// @param rangeCount number of ranges
+/// @param log the log to use
+void nbsPendingStepsRangesDebugOutput(const NbsPendingRange* ranges, const char* debug, size_t rangeCount, Clog log)
+{
+#if defined CLOG_LOG_ENABLED
+    CLOG_C_VERBOSE(&log, "=== pending ranges '%s' (count:%zu)", debug, rangeCount)
+    for (size_t i = 0; i < rangeCount; ++i) {
+        const NbsPendingRange* range = &ranges[i];
+        CLOG_C_VERBOSE(&log, "  %zu: %08X - %08X (count:%zu)", i, range->startId,
+                       range->startId + (StepId) range->count - 1, range->count)
+    }
+#else
+    (void) ranges;
+    (void) debug;
+    (void) rangeCount;
+    (void) log;
+#endif
+}
+
+/// Debug logging
+/// @param self pending steps
+/// @param debug description
+void nbsPendingStepsDebugOutput(const NbsPendingSteps* self, const char* debug)
+{
+#if defined CLOG_LOG_ENABLED
+    CLOG_C_VERBOSE(&self->log, "=== pending steps '%s' expecting %08X (count:%zu)", debug, self->expectingReadId,
+                   self->storedCount)
+    for (size_t i = 0; i < self->windowSize; ++i) {
+        StepId stepId = self->expectingReadId + (StepId) i;
+        const NbsPendingStep* step = &self->steps[nbsPendingStepsSlot(self, stepId)];
+        if (step->isInUse) {
+            CLOG_C_VERBOSE(&self->log, "  %08X (octet count:%zu)", stepId, step->octetCount)
+        }
+    }
+    nimbleStepsReceiveMaskWideDebugMask(&self->receiveMask, debug, self->log);
+#else
+    (void) self;
+    (void) debug;
+#endif
+}
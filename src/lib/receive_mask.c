@@ -0,0 +1,324 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include "bit_scan.h"
+#include <imprint/allocator.h>
+#include <nimble-steps/receive_mask.h>
+
+#if defined __AVX2__
+#include <immintrin.h>
+#endif
+
+#define NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT (64)
+
+/// Initializes the receive mask
+/// All steps before startId are considered received.
+/// @param self receive mask
+/// @param startId the first stepId that is expected to be received
+void nimbleStepsReceiveMaskInit(NimbleStepsReceiveMask* self, StepId startId)
+{
+    self->expectingWriteId = startId;
+    self->receiveMask = NimbleStepsReceiveMaskAllReceived;
+}
+
+static int nimbleStepsReceiveMaskUpdate(StepId* expectingWriteId, NimbleStepsReceiveMaskBits* receiveMask,
+                                        StepId stepId)
+{
+    if (stepId >= *expectingWriteId) {
+        StepId advanceCount = stepId - *expectingWriteId + 1;
+        if (advanceCount > NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT) {
+            return NimbleStepErrTooFarAhead;
+        }
+        if (advanceCount == NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT) {
+            *receiveMask = 0;
+        } else {
+            *receiveMask <<= advanceCount;
+        }
+        *receiveMask |= 1;
+        *expectingWriteId = stepId + 1;
+        return 0;
+    }
+
+    StepId bitIndex = *expectingWriteId - 1 - stepId;
+    if (bitIndex >= NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT) {
+        return NimbleStepErrTooOld;
+    }
+
+    *receiveMask |= (NimbleStepsReceiveMaskBits) 1 << bitIndex;
+
+    return 0;
+}
+
+/// Marks a step as received
+/// Bit zero in the mask is the step right before expectingWriteId, bit one the one before that and so on.
+/// @param self receive mask
+/// @param stepId the received stepId
+/// @return negative if the stepId is too far in the future or in the past to fit in the mask
+int nimbleStepsReceiveMaskReceivedStep(NimbleStepsReceiveMask* self, StepId stepId)
+{
+    return nimbleStepsReceiveMaskUpdate(&self->expectingWriteId, &self->receiveMask, stepId);
+}
+
+/// Debug logging of the receive mask
+/// The oldest step is shown to the left and the most recent one to the right
+/// @param self receive mask
+/// @param debug description
+/// @param log the log to use
+void nimbleStepsReceiveMaskDebugMask(const NimbleStepsReceiveMask* self, const char* debug, Clog log)
+{
+#if defined CLOG_LOG_ENABLED
+    char bits[NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT + 1];
+
+    for (size_t i = 0; i < NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT; ++i) {
+        size_t bitIndex = NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT - 1 - i;
+        bits[i] = ((self->receiveMask >> bitIndex) & 1) ? '1' : '0';
+    }
+    bits[NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT] = 0;
+
+    CLOG_C_VERBOSE(&log, "receive mask '%s' expecting %08X: %s", debug, self->expectingWriteId, bits)
+#else
+    (void) self;
+    (void) debug;
+    (void) log;
+#endif
+}
+
+/// Initializes a wide receive mask
+/// All steps before startId are considered received.
+/// @param self wide receive mask
+/// @param startId the first stepId that is expected to be received
+/// @param bitCount number of steps to cover, must be a multiple of 64 and at most 256
+void nimbleStepsReceiveMaskWideInit(NimbleStepsReceiveMaskWide* self, StepId startId, size_t bitCount)
+{
+    size_t wordCount = bitCount / NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT;
+    if (wordCount == 0) {
+        wordCount = 1;
+    } else if (wordCount > NIMBLE_STEPS_RECEIVE_MASK_WIDE_MAX_WORD_COUNT) {
+        wordCount = NIMBLE_STEPS_RECEIVE_MASK_WIDE_MAX_WORD_COUNT;
+    }
+
+    self->expectingWriteId = startId;
+    self->wordCount = wordCount;
+    for (size_t i = 0; i < NIMBLE_STEPS_RECEIVE_MASK_WIDE_MAX_WORD_COUNT; ++i) {
+        self->words[i] = NimbleStepsReceiveMaskAllReceived;
+    }
+}
+
+static void nimbleStepsReceiveMaskWideShiftToOlder(NimbleStepsReceiveMaskWide* self, size_t bitShiftCount)
+{
+    size_t wordShift = bitShiftCount / NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT;
+    size_t bitShift = bitShiftCount % NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT;
+
+    for (size_t i = self->wordCount; i-- > 0;) {
+        NimbleStepsReceiveMaskBits value = 0;
+        if (i >= wordShift) {
+            value = self->words[i - wordShift] << bitShift;
+            if (bitShift != 0 && i > wordShift) {
+                value |= self->words[i - wordShift - 1] >> (NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT - bitShift);
+            }
+        }
+        self->words[i] = value;
+    }
+}
+
+/// Marks a step as received in a wide receive mask
+/// @param self wide receive mask
+/// @param stepId the received stepId
+/// @return negative if the stepId is too far in the future or in the past to fit in the mask
+int nimbleStepsReceiveMaskWideReceivedStep(NimbleStepsReceiveMaskWide* self, StepId stepId)
+{
+    size_t bitCount = self->wordCount * NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT;
+
+    if (stepId >= self->expectingWriteId) {
+        StepId advanceCount = stepId - self->expectingWriteId + 1;
+        if (advanceCount > bitCount) {
+            return NimbleStepErrTooFarAhead;
+        }
+        nimbleStepsReceiveMaskWideShiftToOlder(self, advanceCount);
+        self->words[0] |= 1;
+        self->expectingWriteId = stepId + 1;
+        return 0;
+    }
+
+    StepId bitIndex = self->expectingWriteId - 1 - stepId;
+    if (bitIndex >= bitCount) {
+        return NimbleStepErrTooOld;
+    }
+
+    self->words[bitIndex / NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT] |= (NimbleStepsReceiveMaskBits) 1
+                                                                   << (bitIndex % NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT);
+
+    return 0;
+}
+
+/// Checks if a step is marked as received
+/// Steps before the mask are considered received, steps from expectingWriteId and onward are not.
+/// @param self wide receive mask
+/// @param stepId the stepId to check
+/// @return true if received
+bool nimbleStepsReceiveMaskWideIsReceived(const NimbleStepsReceiveMaskWide* self, StepId stepId)
+{
+    if (stepId >= self->expectingWriteId) {
+        return false;
+    }
+
+    StepId bitIndex = self->expectingWriteId - 1 - stepId;
+    if (bitIndex >= self->wordCount * NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT) {
+        return true;
+    }
+
+    return (self->words[bitIndex / NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT] >>
+            (bitIndex % NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT)) &
+           1;
+}
+
+/// Counts the steps that are missing in the mask
+/// @param self wide receive mask
+/// @return number of missing steps
+size_t nimbleStepsReceiveMaskWideMissingCount(const NimbleStepsReceiveMaskWide* self)
+{
+    size_t missingCount = 0;
+    for (size_t i = 0; i < self->wordCount; ++i) {
+        missingCount += nbsPopCount64(~self->words[i]);
+    }
+
+    return missingCount;
+}
+
+/// Debug logging of the wide receive mask, one line per word
+/// @param self wide receive mask
+/// @param debug description
+/// @param log the log to use
+void nimbleStepsReceiveMaskWideDebugMask(const NimbleStepsReceiveMaskWide* self, const char* debug, Clog log)
+{
+#if defined CLOG_LOG_ENABLED
+    CLOG_C_VERBOSE(&log, "wide receive mask '%s' expecting %08X (missing:%zu)", debug, self->expectingWriteId,
+                   nimbleStepsReceiveMaskWideMissingCount(self))
+    for (size_t w = 0; w < self->wordCount; ++w) {
+        NimbleStepsReceiveMask wordMask;
+        wordMask.expectingWriteId = self->expectingWriteId - (StepId) (w * NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT);
+        wordMask.receiveMask = self->words[w];
+        nimbleStepsReceiveMaskDebugMask(&wordMask, debug, log);
+    }
+#else
+    (void) self;
+    (void) debug;
+    (void) log;
+#endif
+}
+
+/// Initializes a receive mask table, with one receive mask for each connection
+/// @param self receive mask table
+/// @param allocator allocator for the table
+/// @param connectionCount number of connections
+/// @param startId the first stepId that is expected to be received for all connections
+void nimbleStepsReceiveMaskTableInit(NimbleStepsReceiveMaskTable* self, struct ImprintAllocator* allocator,
+                                     size_t connectionCount, StepId startId)
+{
+    self->expectingWriteIds = IMPRINT_ALLOC_TYPE_COUNT(allocator, StepId, connectionCount);
+    self->receiveMasks = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleStepsReceiveMaskBits, connectionCount);
+    self->connectionCount = connectionCount;
+
+    for (size_t i = 0; i < connectionCount; ++i) {
+        nimbleStepsReceiveMaskTableReset(self, i, startId);
+    }
+}
+
+/// Resets the receive mask for one connection, for example when it reconnects
+/// @param self receive mask table
+/// @param connectionIndex index of the connection
+/// @param startId the first stepId that is expected to be received
+void nimbleStepsReceiveMaskTableReset(NimbleStepsReceiveMaskTable* self, size_t connectionIndex, StepId startId)
+{
+    self->expectingWriteIds[connectionIndex] = startId;
+    self->receiveMasks[connectionIndex] = NimbleStepsReceiveMaskAllReceived;
+}
+
+/// Gets the receive mask for one connection
+/// @param self receive mask table
+/// @param connectionIndex index of the connection
+/// @param receiveMask the receive mask to fill out
+void nimbleStepsReceiveMaskTableGet(const NimbleStepsReceiveMaskTable* self, size_t connectionIndex,
+                                    NimbleStepsReceiveMask* receiveMask)
+{
+    receiveMask->expectingWriteId = self->expectingWriteIds[connectionIndex];
+    receiveMask->receiveMask = self->receiveMasks[connectionIndex];
+}
+
+/// Marks a batch of received steps, for example all the steps in the datagrams read in one tick
+/// Works as nimbleStepsReceiveMaskReceivedStep for each arrival, in order.
+/// @param self receive mask table
+/// @param arrivals the received steps
+/// @param arrivalCount number of arrivals
+/// @return number of arrivals that were too far in the future or in the past to fit in the mask
+size_t nimbleStepsReceiveMaskTableReceivedSteps(NimbleStepsReceiveMaskTable* self,
+                                                const NimbleStepsReceiveMaskArrival* arrivals, size_t arrivalCount)
+{
+    // The same connection can be in a batch more than once, so the updates are done one at a time
+    size_t rejectedCount = 0;
+    for (size_t i = 0; i < arrivalCount; ++i) {
+        size_t connectionIndex = arrivals[i].connectionIndex;
+        int result = nimbleStepsReceiveMaskUpdate(&self->expectingWriteIds[connectionIndex],
+                                                  &self->receiveMasks[connectionIndex], arrivals[i].stepId);
+        if (result < 0) {
+            rejectedCount++;
+        }
+    }
+
+    return rejectedCount;
+}
+
+static NimbleStepsReceiveMaskBits nimbleStepsReceiveMaskAckMask(StepId expectingWriteId,
+                                                                NimbleStepsReceiveMaskBits receiveMask, StepId headId)
+{
+    int32_t distance = (int32_t) (headId - expectingWriteId);
+    if (distance >= 0) {
+        return distance >= NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT ? 0 : receiveMask << distance;
+    }
+
+    int64_t shift = -(int64_t) distance;
+    if (shift >= NIMBLE_STEPS_RECEIVE_MASK_BIT_COUNT) {
+        return NimbleStepsReceiveMaskAllReceived;
+    }
+
+    return (receiveMask >> shift) | ~(NimbleStepsReceiveMaskAllReceived >> shift);
+}
+
+/// Calculates the receive mask of every connection relative to the same headId, so that they can be compared
+/// Bit zero is the step right before headId. Steps from expectingWriteId and onward are not received, and steps
+/// before the receive mask are considered received.
+/// Uses AVX2 when the library is compiled with it, four connections at a time.
+/// @param self receive mask table
+/// @param headId the stepId that the masks are aligned to, typically the next step to send
+/// @param ackMasks one mask for each connection
+void nimbleStepsReceiveMaskTableAckMasks(const NimbleStepsReceiveMaskTable* self, StepId headId,
+                                         NimbleStepsReceiveMaskBits* ackMasks)
+{
+    size_t i = 0;
+
+#if defined __AVX2__
+    __m128i head = _mm_set1_epi32((int) headId);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i allReceived = _mm256_set1_epi64x(-1);
+    for (; i + 4 <= self->connectionCount; i += 4) {
+        __m128i expecting = _mm_loadu_si128((const void*) (self->expectingWriteIds + i));
+        __m256i receiveMasks = _mm256_loadu_si256((const void*) (self->receiveMasks + i));
+
+        // Variable shifts of 64 or more give zero, which is what the scalar version does with a branch
+        __m256i distance = _mm256_cvtepi32_epi64(_mm_sub_epi32(head, expecting));
+        __m256i isAhead = _mm256_cmpgt_epi64(zero, distance);
+        __m256i shift = _mm256_sub_epi64(zero, distance);
+
+        __m256i behind = _mm256_sllv_epi64(receiveMasks, distance);
+        __m256i ahead = _mm256_or_si256(_mm256_srlv_epi64(receiveMasks, shift),
+                                        _mm256_xor_si256(_mm256_srlv_epi64(allReceived, shift), allReceived));
+
+        _mm256_storeu_si256((void*) (ackMasks + i), _mm256_blendv_epi8(behind, ahead, isAhead));
+    }
+#endif
+
+    for (; i < self->connectionCount; ++i) {
+        ackMasks[i] = nimbleStepsReceiveMaskAckMask(self->expectingWriteIds[i], self->receiveMasks[i], headId);
+    }
+}
@@ -0,0 +1,160 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include <clog/clog.h>
+#include <flood/out_stream.h>
+#include <nimble-steps/pending_steps.h>
+#include <nimble-steps/redundant_steps.h>
+#include <nimble-steps/steps.h>
+
+#define NBS_REDUNDANT_STEPS_RANGE_HEADER_OCTET_COUNT (5)
+#define NBS_REDUNDANT_STEPS_STEP_HEADER_OCTET_COUNT (2)
+
+/// Writes a range of steps, split into chunks of at most NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT steps
+/// @return false if the budget was reached
+static bool nbsRedundantStepsWriteRange(const NbsSteps* steps, StepId startId, size_t count, FldOutStream* stream,
+                                        size_t endPos, size_t* rangeCount, size_t* stepCount)
+{
+    // The steps are stored in order, so only the first step needs an index lookup
+    int infoIndex = nbsStepsGetIndexForStep(steps, startId);
+    if (infoIndex < 0) {
+        return true;
+    }
+
+    while (count > 0) {
+        const StepInfo* firstInfo = &steps->infos[infoIndex];
+        if (stream->pos + NBS_REDUNDANT_STEPS_RANGE_HEADER_OCTET_COUNT + NBS_REDUNDANT_STEPS_STEP_HEADER_OCTET_COUNT +
+                firstInfo->octetCount >
+            endPos) {
+            return false;
+        }
+
+        fldOutStreamWriteUInt32(stream, startId);
+        size_t countPos = stream->pos;
+        fldOutStreamWriteUInt8(stream, 0);
+        (*rangeCount)++;
+
+        size_t chunkCount = count < NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT ? count
+                                                                             : NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT;
+        size_t writtenCount = 0;
+        for (; writtenCount < chunkCount; ++writtenCount) {
+            NbsStepView view;
+            int octetCount = nbsStepsViewAtIndex(steps, infoIndex, &view);
+            if (stream->pos + NBS_REDUNDANT_STEPS_STEP_HEADER_OCTET_COUNT + (size_t) octetCount > endPos) {
+                break;
+            }
+            fldOutStreamWriteUInt16(stream, (uint16_t) octetCount);
+            fldOutStreamWriteOctets(stream, view.first.payload, view.first.octetCount);
+            if (view.second.octetCount > 0) {
+                fldOutStreamWriteOctets(stream, view.second.payload, view.second.octetCount);
+            }
+            infoIndex = (size_t) infoIndex + 1 == steps->windowSize ? 0 : infoIndex + 1;
+        }
+
+        stream->octets[countPos] = (uint8_t) writtenCount;
+        *stepCount += writtenCount;
+        if (writtenCount < chunkCount) {
+            return false;
+        }
+
+        startId += (StepId) writtenCount;
+        count -= writtenCount;
+    }
+
+    return true;
+}
+
+static int nbsRedundantStepsWriteFromRanges(const NbsSteps* steps, StepId headId, NbsPendingRange* ranges,
+                                            size_t rangeCount, FldOutStream* stream, size_t maxOctetCount)
+{
+    size_t endPos = stream->pos + maxOctetCount;
+    if (endPos > stream->size) {
+        endPos = stream->size;
+    }
+
+    if (stream->pos + 1 > endPos) {
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    size_t rangeCountPos = stream->pos;
+    fldOutStreamWriteUInt8(stream, 0);
+
+    // The steps from the head of the receive mask and onward have not been received at all
+    if (steps->expectedWriteId > headId) {
+        ranges[rangeCount].startId = headId;
+        ranges[rangeCount].count = steps->expectedWriteId - headId;
+        rangeCount++;
+    }
+
+    size_t writtenRangeCount = 0;
+    size_t writtenStepCount = 0;
+    for (size_t i = 0; i < rangeCount; ++i) {
+        StepId startId = ranges[i].startId;
+        StepId endId = startId + (StepId) ranges[i].count;
+        if (startId < steps->expectedReadId) {
+            startId = steps->expectedReadId;
+        }
+        if (endId > steps->expectedWriteId) {
+            endId = steps->expectedWriteId;
+        }
+        if (startId >= endId || steps->stepsCount == 0) {
+            continue;
+        }
+
+        if (writtenRangeCount + (endId - startId) / NBS_REDUNDANT_STEPS_MAX_RANGE_STEP_COUNT + 1 > UINT8_MAX) {
+            break;
+        }
+
+        bool hasRoomLeft = nbsRedundantStepsWriteRange(steps, startId, endId - startId, stream, endPos,
+                                                       &writtenRangeCount, &writtenStepCount);
+        if (!hasRoomLeft) {
+            break;
+        }
+    }
+
+    stream->octets[rangeCountPos] = (uint8_t) writtenRangeCount;
+
+    return (int) writtenStepCount;
+}
+
+/// Writes the steps that a peer has not acknowledged, oldest first, until the octet budget is reached
+/// Format: range count (uint8), then for each range: start StepId (uint32), step count (uint8) and for each step
+/// the octet count (uint16) and the payload.
+/// @param steps steps to send from
+/// @param receiveMask the receive mask reported by the peer
+/// @param stream stream to write to
+/// @param maxOctetCount maximum number of octets to write, typically what is left of the datagram
+/// @return number of steps written or negative on error
+int nbsRedundantStepsWrite(const struct NbsSteps* steps, const NimbleStepsReceiveMask* receiveMask,
+                           struct FldOutStream* stream, size_t maxOctetCount)
+{
+    NbsPendingRange ranges[64 / 2 + 1];
+    StepId lastAvailableId = steps->expectedWriteId - 1;
+
+    int rangeCount = nbsPendingStepsRanges(receiveMask->expectingWriteId, lastAvailableId, receiveMask->receiveMask,
+                                           ranges, 64 / 2, 64);
+
+    return nbsRedundantStepsWriteFromRanges(steps, receiveMask->expectingWriteId, ranges, (size_t) rangeCount, stream,
+                                            maxOctetCount);
+}
+
+/// Writes the steps that a peer has not acknowledged according to a wide receive mask
+/// @param steps steps to send from
+/// @param receiveMask the wide receive mask reported by the peer
+/// @param stream stream to write to
+/// @param maxOctetCount maximum number of octets to write, typically what is left of the datagram
+/// @return number of steps written or negative on error
+int nbsRedundantStepsWriteWide(const struct NbsSteps* steps, const NimbleStepsReceiveMaskWide* receiveMask,
+                               struct FldOutStream* stream, size_t maxOctetCount)
+{
+    NbsPendingRange ranges[NBS_PENDING_STEPS_MAX_WINDOW_SIZE / 2 + 1];
+    StepId lastAvailableId = steps->expectedWriteId - 1;
+
+    int rangeCount = nbsPendingStepsRangesWide(receiveMask, lastAvailableId, ranges,
+                                               NBS_PENDING_STEPS_MAX_WINDOW_SIZE / 2,
+                                               NBS_PENDING_STEPS_MAX_WINDOW_SIZE);
+
+    return nbsRedundantStepsWriteFromRanges(steps, receiveMask->expectingWriteId, ranges, (size_t) rangeCount, stream,
+                                            maxOctetCount);
+}
@@ -0,0 +1,228 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include "nbs_atomic.h"
+#include "nbs_log.h"
+#include <clog/clog.h>
+#include <imprint/allocator.h>
+#include <nimble-steps/spsc_steps.h>
+
+/// Initializes the single producer, single consumer steps buffer and allocates all memory needed
+/// @note you must call nbsSpscStepsReInit directly after a call to this function
+/// @param self spsc steps
+/// @param allocator allocator to use for step allocation
+/// @param maxOctetSizeForCombinedStep maximum number of octets for each combined step
+/// @param windowSize number of step infos in the window, must be a power of two. Half of it can hold steps.
+/// @param log the log to use
+/// @return negative on error, and then nothing is allocated
+int nbsSpscStepsInit(NbsSpscSteps* self, struct ImprintAllocator* allocator, size_t maxOctetSizeForCombinedStep,
+                     size_t windowSize, Clog log)
+{
+    tc_mem_clear_type(self);
+    self->log = log;
+
+    if (windowSize < 4 || (windowSize & (windowSize - 1)) != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "nbsSpscStepsInit: window size must be a power of two, but encountered %zu",
+                          windowSize)
+        return NimbleStepErrWindowSize;
+    }
+
+    size_t payloadCapacity = maxOctetSizeForCombinedStep * (windowSize / 2);
+    if (payloadCapacity > UINT32_MAX) {
+        CLOG_C_SOFT_ERROR(&self->log, "nbsSpscStepsInit: buffer of %zu octets is too big for the step infos",
+                          payloadCapacity)
+        return NimbleStepErrNotSupported;
+    }
+
+    self->windowSize = windowSize;
+    self->infos = IMPRINT_ALLOC_TYPE_COUNT(allocator, StepInfo, windowSize);
+    self->payloadCapacity = payloadCapacity;
+    self->payload = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, self->payloadCapacity);
+
+    return 0;
+}
+
+/// Clears the buffer and sets a new starting StepId
+/// @note must not be called while the producer or consumer threads are using the buffer
+/// @param self spsc steps
+/// @param initialId starting stepId for the buffer. The next write must be exactly for this StepId.
+void nbsSpscStepsReInit(NbsSpscSteps* self, StepId initialId)
+{
+    self->writtenCount = 0;
+    self->readCount = 0;
+    self->writeOctetIndex = 0;
+    self->expectedWriteId = initialId;
+    self->expectedReadId = initialId;
+}
+
+/// Returns the number of steps stored in the buffer
+/// Can be called from both threads, but it is only a snapshot if the other thread is active.
+/// @param self spsc steps
+/// @return number of steps available for reading
+size_t nbsSpscStepsCount(const NbsSpscSteps* self)
+{
+    size_t readCount = nbsAtomicLoadAcquire(&self->readCount);
+    size_t writtenCount = nbsAtomicLoadAcquire(&self->writtenCount);
+
+    return writtenCount - readCount;
+}
+
+/// Writes a step to the buffer. Must only be called from the producer thread.
+/// @param self spsc steps
+/// @param stepId must be exactly the expected write id
+/// @param data application specific step payload
+/// @param octetCount number of octets in data
+/// @return negative on error
+int nbsSpscStepsWrite(NbsSpscSteps* self, StepId stepId, const uint8_t* data, size_t octetCount)
+{
+    if (self->expectedWriteId != stepId) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "spsc: expected write %08X but got %08X", self->expectedWriteId, stepId)
+        return NimbleStepErrWrongStepId;
+    }
+
+    if (octetCount < NimbleStepMinimumSingleStepOctetCount || octetCount > UINT16_MAX) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "spsc: step %08X has wrong octet count %zu", stepId, octetCount)
+        return NimbleStepErrWrongOctetCount;
+    }
+
+    size_t readCount = nbsAtomicLoadAcquire(&self->readCount);
+    size_t storedCount = self->writtenCount - readCount;
+    if (storedCount >= self->windowSize / 2) {
+        return NimbleStepErrBufferFull;
+    }
+
+    // The oldest unread info is only written by this thread, so it tells where the consumer is in the payload.
+    // A stale readCount only reports less free space.
+    size_t freeOctetCount;
+    if (storedCount == 0) {
+        freeOctetCount = self->payloadCapacity;
+    } else {
+        size_t readOctetIndex = self->infos[readCount & (self->windowSize - 1)].positionInBuffer;
+        freeOctetCount = (readOctetIndex + self->payloadCapacity - self->writeOctetIndex) % self->payloadCapacity;
+    }
+
+    if (octetCount > freeOctetCount) {
+        return NimbleStepErrBufferFull;
+    }
+
+    size_t octetCountUntilEnd = self->payloadCapacity - self->writeOctetIndex;
+    if (octetCount <= octetCountUntilEnd) {
+        tc_memcpy_octets(self->payload + self->writeOctetIndex, data, octetCount);
+    } else {
+        tc_memcpy_octets(self->payload + self->writeOctetIndex, data, octetCountUntilEnd);
+        tc_memcpy_octets(self->payload, data + octetCountUntilEnd, octetCount - octetCountUntilEnd);
+    }
+
+    StepInfo* info = &self->infos[self->writtenCount & (self->windowSize - 1)];
+    info->octetCount = (uint16_t) octetCount;
+    info->positionInBuffer = (uint32_t) self->writeOctetIndex;
+
+    self->writeOctetIndex = (self->writeOctetIndex + octetCount) % self->payloadCapacity;
+    self->expectedWriteId++;
+
+    nbsAtomicStoreRelease(&self->writtenCount, self->writtenCount + 1);
+
+    return (int) octetCount;
+}
+
+static const StepInfo* nbsSpscStepsTailInfo(const NbsSpscSteps* self)
+{
+    size_t writtenCount = nbsAtomicLoadAcquire(&self->writtenCount);
+    if (writtenCount == self->readCount) {
+        return 0;
+    }
+
+    return &self->infos[self->readCount & (self->windowSize - 1)];
+}
+
+static void nbsSpscStepsAdvanceTail(NbsSpscSteps* self, size_t stepCount)
+{
+    self->expectedReadId += (StepId) stepCount;
+    nbsAtomicStoreRelease(&self->readCount, self->readCount + stepCount);
+}
+
+/// Reads the next step in the buffer, if any. Must only be called from the consumer thread.
+/// @param self spsc steps
+/// @param stepId the stepId of the read step
+/// @param data the step payload will be copied to this
+/// @param maxTarget maximum number of octets to copy to data
+/// @return octet count for the step read, or negative value on error
+int nbsSpscStepsRead(NbsSpscSteps* self, StepId* stepId, uint8_t* data, size_t maxTarget)
+{
+    const StepInfo* info = nbsSpscStepsTailInfo(self);
+    if (info == 0) {
+        return NimbleStepErrCollectionIsEmpty;
+    }
+
+    if (info->octetCount > maxTarget) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "spsc: target buffer is too small %zu %zu", (size_t) info->octetCount,
+                             maxTarget)
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    size_t octetCountUntilEnd = self->payloadCapacity - info->positionInBuffer;
+    if (info->octetCount <= octetCountUntilEnd) {
+        tc_memcpy_octets(data, self->payload + info->positionInBuffer, info->octetCount);
+    } else {
+        tc_memcpy_octets(data, self->payload + info->positionInBuffer, octetCountUntilEnd);
+        tc_memcpy_octets(data + octetCountUntilEnd, self->payload, info->octetCount - octetCountUntilEnd);
+    }
+
+    *stepId = self->expectedReadId;
+    size_t octetCount = info->octetCount;
+
+    nbsSpscStepsAdvanceTail(self, 1);
+
+    return (int) octetCount;
+}
+
+/// Gets a zero-copy view of the next step to read. Must only be called from the consumer thread.
+/// The view is valid until the step is discarded.
+/// @param self spsc steps
+/// @param view the view to fill out
+/// @return total octet count of the step, or negative on error
+int nbsSpscStepsPeekView(const NbsSpscSteps* self, NbsStepView* view)
+{
+    const StepInfo* info = nbsSpscStepsTailInfo(self);
+    if (info == 0) {
+        return NimbleStepErrCollectionIsEmpty;
+    }
+
+    size_t octetCountUntilEnd = self->payloadCapacity - info->positionInBuffer;
+
+    view->stepId = self->expectedReadId;
+    view->first.payload = self->payload + info->positionInBuffer;
+    if (info->octetCount <= octetCountUntilEnd) {
+        view->first.octetCount = info->octetCount;
+        view->second.payload = 0;
+        view->second.octetCount = 0;
+    } else {
+        view->first.octetCount = octetCountUntilEnd;
+        view->second.payload = self->payload;
+        view->second.octetCount = info->octetCount - octetCountUntilEnd;
+    }
+
+    return (int) info->octetCount;
+}
+
+/// Discards a number of steps from the buffer. Must only be called from the consumer thread.
+/// @param self spsc steps
+/// @param stepCountToDiscard number of steps to discard
+/// @return number of steps discarded, or negative on error
+int nbsSpscStepsDiscardCount(NbsSpscSteps* self, size_t stepCountToDiscard)
+{
+    size_t writtenCount = nbsAtomicLoadAcquire(&self->writtenCount);
+    size_t storedCount = writtenCount - self->readCount;
+    if (stepCountToDiscard > storedCount) {
+        stepCountToDiscard = storedCount;
+    }
+
+    if (stepCountToDiscard == 0) {
+        return 0;
+    }
+
+    nbsSpscStepsAdvanceTail(self, stepCountToDiscard);
+
+    return (int) stepCountToDiscard;
+}
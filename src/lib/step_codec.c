@@ -0,0 +1,291 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include "nbs_log.h"
+#include <clog/clog.h>
+#include <nimble-steps/step_codec.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+
+static size_t nbsStepCodecWriteVarint(uint8_t* target, size_t value)
+{
+    size_t count = 0;
+    while (value >= 0x80) {
+        target[count++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    target[count++] = (uint8_t) value;
+
+    return count;
+}
+
+static int nbsStepCodecReadVarint(const uint8_t* source, size_t octetCount, size_t* pos, size_t* value)
+{
+    size_t result = 0;
+    for (size_t shift = 0; shift < 21; shift += 7) {
+        if (*pos >= octetCount) {
+            return NimbleStepErrMalformedStep;
+        }
+        uint8_t octet = source[(*pos)++];
+        result |= (size_t) (octet & 0x7f) << shift;
+        if ((octet & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return NimbleStepErrMalformedStep;
+}
+
+static inline uint8_t nbsStepCodecDelta(const NbsStepCodec* self, const uint8_t* step, size_t index)
+{
+    uint8_t previous = index < self->previousOctetCount ? self->previous[index] : 0;
+    return step[index] ^ previous;
+}
+
+/// Resets the codec, the next step is encoded as a keyframe
+/// @param self codec
+void nbsStepCodecInit(NbsStepCodec* self)
+{
+    self->previousOctetCount = 0;
+    self->hasPrevious = false;
+    self->previousStepId = 0;
+    self->deltaCount = 0;
+}
+
+/// Encodes a step as the difference to the previously encoded step, or as a keyframe
+/// @param self encoder
+/// @param step the step payload
+/// @param octetCount number of octets in step
+/// @param target encoded octets are written here
+/// @param maxTarget size of target, octetCount + NBS_STEP_CODEC_MAX_OVERHEAD_OCTET_COUNT is always enough
+/// @return number of encoded octets or negative on error
+int nbsStepCodecEncode(NbsStepCodec* self, const uint8_t* step, size_t octetCount, uint8_t* target, size_t maxTarget)
+{
+    if (octetCount > NBS_STEP_CODEC_MAX_OCTET_COUNT) {
+        return NimbleStepErrWrongOctetCount;
+    }
+
+    if (maxTarget < octetCount + NBS_STEP_CODEC_MAX_OVERHEAD_OCTET_COUNT) {
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    bool isDelta = self->hasPrevious && self->deltaCount + 1 < NBS_STEP_CODEC_KEYFRAME_INTERVAL;
+    if (isDelta) {
+        self->deltaCount++;
+    } else {
+        // A keyframe is encoded against an empty step
+        self->previousOctetCount = 0;
+        self->deltaCount = 0;
+    }
+
+    size_t pos = nbsStepCodecWriteVarint(target, octetCount << 1 | (isDelta ? 1u : 0u));
+    size_t index = 0;
+
+    while (index < octetCount) {
+        size_t zeroStart = index;
+        while (index < octetCount && nbsStepCodecDelta(self, step, index) == 0) {
+            index++;
+        }
+
+        // A single zero octet is cheaper to keep in the literal than to start a new run for
+        size_t literalStart = index;
+        while (index < octetCount) {
+            if (nbsStepCodecDelta(self, step, index) == 0 && index + 1 < octetCount &&
+                nbsStepCodecDelta(self, step, index + 1) == 0) {
+                break;
+            }
+            index++;
+        }
+
+        pos += nbsStepCodecWriteVarint(target + pos, literalStart - zeroStart);
+        pos += nbsStepCodecWriteVarint(target + pos, index - literalStart);
+        for (size_t i = literalStart; i < index; ++i) {
+            target[pos++] = nbsStepCodecDelta(self, step, i);
+        }
+    }
+
+    tc_memcpy_octets(self->previous, step, octetCount);
+    self->previousOctetCount = octetCount;
+    self->hasPrevious = true;
+
+    return (int) pos;
+}
+
+static int nbsStepCodecDecodeWithReference(NbsStepCodec* self, const uint8_t* encoded, size_t encodedOctetCount,
+                                           uint8_t* target, size_t maxTarget, bool hasReference)
+{
+    size_t pos = 0;
+    size_t header;
+    if (nbsStepCodecReadVarint(encoded, encodedOctetCount, &pos, &header) < 0) {
+        return NimbleStepErrMalformedStep;
+    }
+
+    bool isDelta = (header & 1u) != 0;
+    size_t octetCount = header >> 1;
+    if (isDelta && !hasReference) {
+        return NimbleStepErrMissingDeltaReference;
+    }
+
+    if (octetCount > NBS_STEP_CODEC_MAX_OCTET_COUNT) {
+        return NimbleStepErrMalformedStep;
+    }
+
+    if (octetCount > maxTarget) {
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    size_t referenceOctetCount = isDelta ? self->previousOctetCount : 0;
+
+    size_t index = 0;
+    while (index < octetCount) {
+        size_t zeroRunCount;
+        size_t literalCount;
+        if (nbsStepCodecReadVarint(encoded, encodedOctetCount, &pos, &zeroRunCount) < 0 ||
+            nbsStepCodecReadVarint(encoded, encodedOctetCount, &pos, &literalCount) < 0) {
+            return NimbleStepErrMalformedStep;
+        }
+
+        if ((zeroRunCount == 0 && literalCount == 0) || zeroRunCount + literalCount > octetCount - index ||
+            literalCount > encodedOctetCount - pos) {
+            return NimbleStepErrMalformedStep;
+        }
+
+        for (size_t i = 0; i < zeroRunCount; ++i, ++index) {
+            target[index] = index < referenceOctetCount ? self->previous[index] : 0;
+        }
+
+        for (size_t i = 0; i < literalCount; ++i, ++index) {
+            uint8_t previous = index < referenceOctetCount ? self->previous[index] : 0;
+            target[index] = encoded[pos++] ^ previous;
+        }
+    }
+
+    tc_memcpy_octets(self->previous, target, octetCount);
+    self->previousOctetCount = octetCount;
+    self->hasPrevious = true;
+
+    return (int) octetCount;
+}
+
+/// Decodes a step that was encoded with nbsStepCodecEncode
+/// @param self decoder
+/// @param encoded the encoded octets
+/// @param encodedOctetCount number of octets in encoded
+/// @param target the decoded step is written here
+/// @param maxTarget size of target
+/// @return octet count of the decoded step or negative on error
+int nbsStepCodecDecode(NbsStepCodec* self, const uint8_t* encoded, size_t encodedOctetCount, uint8_t* target,
+                       size_t maxTarget)
+{
+    return nbsStepCodecDecodeWithReference(self, encoded, encodedOctetCount, target, maxTarget, self->hasPrevious);
+}
+
+/// Delta encodes a step directly into the steps buffer
+/// A step that does not follow the previously encoded step is encoded as a keyframe.
+/// @param steps steps
+/// @param encoder the encoder for this steps buffer
+/// @param stepId must be the expectedWriteId.
+/// @param step the step payload
+/// @param octetCount number of octets in step
+/// @return number of encoded octets stored or negative on error
+int nbsStepsWriteDelta(struct NbsSteps* steps, NbsStepCodec* encoder, StepId stepId, const uint8_t* step,
+                       size_t octetCount)
+{
+    if (encoder->hasPrevious && encoder->previousStepId + 1 != stepId) {
+        nbsStepCodecInit(encoder);
+    }
+
+    size_t maxEncodedOctetCount = octetCount + NBS_STEP_CODEC_MAX_OVERHEAD_OCTET_COUNT;
+    int storedOctetCount;
+    if (maxEncodedOctetCount <= steps->maxStepOctetCount) {
+        uint8_t* target;
+        int errorCode = nbsStepsWriteReserve(steps, stepId, maxEncodedOctetCount, &target);
+        if (errorCode < 0) {
+            return errorCode;
+        }
+
+        int encodedOctetCount = nbsStepCodecEncode(encoder, step, octetCount, target, maxEncodedOctetCount);
+        if (encodedOctetCount < 0) {
+            nbsStepsWriteCancel(steps);
+            return encodedOctetCount;
+        }
+
+        storedOctetCount = nbsStepsWriteCommit(steps, (size_t) encodedOctetCount);
+    } else {
+        // The worst case encoding is larger than a step can be, so encode on the side and store it if it fits
+        uint8_t encoded[NBS_STEP_CODEC_MAX_OCTET_COUNT + NBS_STEP_CODEC_MAX_OVERHEAD_OCTET_COUNT];
+        int encodedOctetCount = nbsStepCodecEncode(encoder, step, octetCount, encoded, sizeof(encoded));
+        if (encodedOctetCount < 0) {
+            return encodedOctetCount;
+        }
+
+        storedOctetCount = nbsStepsWrite(steps, stepId, encoded, (size_t) encodedOctetCount);
+    }
+
+    if (storedOctetCount < 0) {
+        // The encoder has moved on to a step that was never stored
+        nbsStepCodecInit(encoder);
+        return storedOctetCount;
+    }
+    encoder->previousStepId = stepId;
+
+    return storedOctetCount;
+}
+
+/// Reads and decodes the next step, that was written with nbsStepsWriteDelta
+/// A delta step can only be decoded directly after the step it refers to. If steps were discarded or read in another way
+/// in between, the step is skipped and NimbleStepErrMissingDeltaReference is returned until the next keyframe.
+/// @param steps steps
+/// @param decoder the decoder for this steps buffer
+/// @param stepId set to the StepId of the step
+/// @param target the decoded step is written here
+/// @param maxTarget size of target
+/// @return octet count of the decoded step or negative on error
+int nbsStepsReadDelta(struct NbsSteps* steps, NbsStepCodec* decoder, StepId* stepId, uint8_t* target,
+                      size_t maxTarget)
+{
+    NbsStepView view;
+    int encodedOctetCount = nbsStepsPeekView(steps, &view);
+    if (encodedOctetCount < 0) {
+        return encodedOctetCount;
+    }
+
+    const uint8_t* encoded = view.first.payload;
+    uint8_t joined[NBS_STEP_CODEC_MAX_OCTET_COUNT + NBS_STEP_CODEC_MAX_OVERHEAD_OCTET_COUNT];
+    if (view.second.octetCount > 0) {
+        // Only steps written without a reservation can be split at the end of the buffer
+        if ((size_t) encodedOctetCount > sizeof(joined)) {
+            return NimbleStepErrWrongOctetCount;
+        }
+        tc_memcpy_octets(joined, view.first.payload, view.first.octetCount);
+        tc_memcpy_octets(joined + view.first.octetCount, view.second.payload, view.second.octetCount);
+        encoded = joined;
+    }
+
+    bool hasReference = decoder->hasPrevious && decoder->previousStepId + 1 == view.stepId;
+    int octetCount = nbsStepCodecDecodeWithReference(decoder, encoded, (size_t) encodedOctetCount, target, maxTarget,
+                                                     hasReference);
+    if (octetCount == NimbleStepErrMissingDeltaReference) {
+        // The step can never be decoded, so skip it and continue at the next keyframe
+        NBS_LOG_C_WARN(&steps->log, "step %08X refers to a step that was not decoded, skipping it", view.stepId)
+        int discardError = nbsStepsDiscard(steps, stepId);
+        if (discardError < 0) {
+            return discardError;
+        }
+        return octetCount;
+    }
+    if (octetCount < 0) {
+        NBS_LOG_C_SOFT_ERROR(&steps->log, "could not decode step %08X %d", view.stepId, octetCount)
+        return octetCount;
+    }
+    decoder->previousStepId = view.stepId;
+
+    int discardError = nbsStepsDiscard(steps, stepId);
+    if (discardError < 0) {
+        return discardError;
+    }
+
+    return octetCount;
+}
@@ -0,0 +1,417 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#if !defined _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "nbs_atomic.h"
+#include "nbs_log.h"
+#include <clog/clog.h>
+#include <mash/murmur.h>
+#include <nimble-steps/step_log.h>
+#include <stdio.h>
+#include <string.h>
+
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define NBS_STEP_LOG_MAGIC (0x4c53424e) // 'NBSL'
+#define NBS_STEP_LOG_VERSION (2)
+#define NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT (24)
+#define NBS_STEP_LOG_MAX_SEGMENT_PATH_LENGTH (NBS_STEP_LOG_MAX_PATH_LENGTH + 24) // room for "." and any size_t
+
+static size_t nbsStepLogDataOffset(size_t stepCapacity)
+{
+    return sizeof(NbsStepLogSegmentHeader) + sizeof(uint32_t) * stepCapacity;
+}
+
+static void nbsStepLogSegmentPath(char* target, size_t maxTarget, const char* basePath, size_t segmentIndex)
+{
+    snprintf(target, maxTarget, "%s.%06zu", basePath, segmentIndex);
+}
+
+static int nbsStepLogSegmentMap(NbsStepLogSegment* segment, const char* path, size_t segmentIndex,
+                                size_t createOctetCount)
+{
+#if defined _WIN32
+    (void) segment;
+    (void) path;
+    (void) segmentIndex;
+    (void) createOctetCount;
+    return NimbleStepErrNotSupported;
+#else
+    bool isCreating = createOctetCount > 0;
+    int fileDescriptor = isCreating ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+    if (fileDescriptor < 0) {
+        return NimbleStepErrFileSystem;
+    }
+
+    size_t octetCount = createOctetCount;
+    if (isCreating) {
+        // The file is sparse until the records are written
+        if (ftruncate(fileDescriptor, (off_t) octetCount) != 0) {
+            close(fileDescriptor);
+            return NimbleStepErrFileSystem;
+        }
+    } else {
+        struct stat fileStat;
+        if (fstat(fileDescriptor, &fileStat) != 0 || (size_t) fileStat.st_size < sizeof(NbsStepLogSegmentHeader)) {
+            close(fileDescriptor);
+            return NimbleStepErrFileSystem;
+        }
+        octetCount = (size_t) fileStat.st_size;
+    }
+
+    int protection = isCreating ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* mapping = mmap(0, octetCount, protection, MAP_SHARED, fileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+        close(fileDescriptor);
+        return NimbleStepErrFileSystem;
+    }
+
+    segment->fileDescriptor = fileDescriptor;
+    segment->octets = (uint8_t*) mapping;
+    segment->octetCount = octetCount;
+    segment->index = segmentIndex;
+
+    return 0;
+#endif
+}
+
+/// Unmaps the segment. If usedOctetCount is not zero, the file is truncated to it.
+static void nbsStepLogSegmentUnmap(NbsStepLogSegment* segment, size_t usedOctetCount)
+{
+#if defined _WIN32
+    (void) segment;
+    (void) usedOctetCount;
+#else
+    if (segment->octets == 0) {
+        return;
+    }
+    munmap(segment->octets, segment->octetCount);
+    if (usedOctetCount > 0) {
+        int truncateResult = ftruncate(segment->fileDescriptor, (off_t) usedOctetCount);
+        (void) truncateResult;
+    }
+    close(segment->fileDescriptor);
+    segment->octets = 0;
+    segment->octetCount = 0;
+#endif
+}
+
+static int nbsStepLogOpenSegment(NbsStepLog* self, size_t segmentIndex)
+{
+    char path[NBS_STEP_LOG_MAX_SEGMENT_PATH_LENGTH];
+    nbsStepLogSegmentPath(path, sizeof(path), self->basePath, segmentIndex);
+
+    size_t dataOffset = nbsStepLogDataOffset(self->stepCapacityPerSegment);
+    size_t maxOctetCount = dataOffset + self->stepCapacityPerSegment *
+                                            (NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT + self->maxOctetCountPerStep);
+
+    int errorCode = nbsStepLogSegmentMap(&self->segment, path, segmentIndex, maxOctetCount);
+    if (errorCode < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not create step log segment '%s' %d", path, errorCode)
+        return errorCode;
+    }
+
+    NbsStepLogSegmentHeader header;
+    header.magic = NBS_STEP_LOG_MAGIC;
+    header.version = NBS_STEP_LOG_VERSION;
+    header.firstStepId = self->firstStepId + (StepId) (segmentIndex * self->stepCapacityPerSegment);
+    header.stepCapacity = (uint32_t) self->stepCapacityPerSegment;
+    header.stepCount = 0;
+    header.octetCount = (uint32_t) dataOffset;
+    header.maxOctetCountPerStep = (uint32_t) self->maxOctetCountPerStep;
+    header.reserved = 0;
+    tc_memcpy_octets(self->segment.octets, &header, sizeof(header));
+
+    self->writeOffset = dataOffset;
+
+    return 0;
+}
+
+/// Creates a step log with the first segment file
+/// @param self step log
+/// @param basePath path and file name prefix for the segment files
+/// @param firstStepId the first StepId that will be appended
+/// @param stepCapacityPerSegment number of steps in each segment file
+/// @param maxOctetCountPerStep maximum octet count for a step payload
+/// @param log the log to use
+/// @return negative on error
+int nbsStepLogCreate(NbsStepLog* self, const char* basePath, StepId firstStepId, size_t stepCapacityPerSegment,
+                     size_t maxOctetCountPerStep, Clog log)
+{
+    tc_mem_clear_type(self);
+    self->log = log;
+
+    size_t pathLength = strlen(basePath);
+    if (pathLength >= NBS_STEP_LOG_MAX_PATH_LENGTH) {
+        CLOG_C_SOFT_ERROR(&self->log, "step log path is too long")
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    size_t maxSegmentOctetCount = nbsStepLogDataOffset(stepCapacityPerSegment) +
+                                  stepCapacityPerSegment *
+                                      (NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT + maxOctetCountPerStep);
+    if (stepCapacityPerSegment == 0 || maxSegmentOctetCount > UINT32_MAX) {
+        CLOG_C_SOFT_ERROR(&self->log, "step log segment of %zu steps is not supported", stepCapacityPerSegment)
+        return NimbleStepErrNotSupported;
+    }
+
+    tc_memcpy_octets(self->basePath, basePath, pathLength + 1);
+    self->firstStepId = firstStepId;
+    self->nextStepId = firstStepId;
+    self->stepCapacityPerSegment = stepCapacityPerSegment;
+    self->maxOctetCountPerStep = maxOctetCountPerStep;
+
+    int errorCode = nbsStepLogOpenSegment(self, 0);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    self->isOpen = true;
+
+    return 0;
+}
+
+/// Appends a step to the log
+/// The step count in the segment header is published with a release store after the record is written, so a reader
+/// that maps the segment never sees a partially written step. The records are not synced to disk. After a power loss
+/// a record that did not reach the disk fails its checksum and is reported as corrupt.
+/// @param self step log
+/// @param stepId must be one more than the previously appended stepId
+/// @param time application specific time for the step
+/// @param payload the step payload
+/// @param octetCount number of octets in payload
+/// @return negative on error
+int nbsStepLogAppend(NbsStepLog* self, StepId stepId, uint64_t time, const uint8_t* payload, size_t octetCount)
+{
+    if (!self->isOpen) {
+        return NimbleStepErrNotOpen;
+    }
+
+    if (stepId != self->nextStepId) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "step log expected %08X but got %08X", self->nextStepId, stepId)
+        return NimbleStepErrWrongStepId;
+    }
+
+    if (octetCount > self->maxOctetCountPerStep) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "step log can not store step of %zu octets", octetCount)
+        return NimbleStepErrWrongOctetCount;
+    }
+
+    size_t stepIndex = stepId - self->firstStepId;
+    size_t segmentIndex = stepIndex / self->stepCapacityPerSegment;
+    if (segmentIndex != self->segment.index) {
+        nbsStepLogSegmentUnmap(&self->segment, self->writeOffset);
+        int errorCode = nbsStepLogOpenSegment(self, segmentIndex);
+        if (errorCode < 0) {
+            self->isOpen = false;
+            return errorCode;
+        }
+    }
+
+    uint8_t* octets = self->segment.octets;
+    uint32_t recordStepId = stepId;
+    uint32_t recordOctetCount = (uint32_t) octetCount;
+    uint8_t* record = octets + self->writeOffset;
+    tc_memcpy_octets(record, &recordStepId, sizeof(recordStepId));
+    tc_memcpy_octets(record + 4, &recordOctetCount, sizeof(recordOctetCount));
+    tc_memcpy_octets(record + 8, &time, sizeof(time));
+    uint32_t checksum = mashMurmurHash3(payload, octetCount);
+    uint32_t reserved = 0;
+    tc_memcpy_octets(record + 16, &checksum, sizeof(checksum));
+    tc_memcpy_octets(record + 20, &reserved, sizeof(reserved));
+    tc_memcpy_octets(record + NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT, payload, octetCount);
+
+    size_t slot = stepIndex % self->stepCapacityPerSegment;
+    uint32_t recordOffset = (uint32_t) self->writeOffset;
+    tc_memcpy_octets(octets + sizeof(NbsStepLogSegmentHeader) + slot * sizeof(uint32_t), &recordOffset,
+                     sizeof(recordOffset));
+
+    self->writeOffset += NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT + octetCount;
+
+    uint32_t stepCount = (uint32_t) (slot + 1);
+    uint32_t usedOctetCount = (uint32_t) self->writeOffset;
+    tc_memcpy_octets(octets + offsetof(NbsStepLogSegmentHeader, octetCount), &usedOctetCount, sizeof(usedOctetCount));
+    nbsAtomicStoreReleaseU32(&((NbsStepLogSegmentHeader*) octets)->stepCount, stepCount);
+
+    self->nextStepId++;
+
+    return 0;
+}
+
+/// Sets the time that is stored with the steps appended by nbsStepLogWriteListener
+/// @param self step log
+/// @param time application specific time
+void nbsStepLogSetTime(NbsStepLog* self, uint64_t time)
+{
+    self->time = time;
+}
+
+/// Write listener that can be set with nbsStepsSetWriteListener to append every written step to the log
+/// @param self step log
+/// @param stepId the stepId of the written step
+/// @param payload the step payload
+/// @param octetCount number of octets in payload
+void nbsStepLogWriteListener(void* self, StepId stepId, const uint8_t* payload, size_t octetCount)
+{
+    NbsStepLog* stepLog = (NbsStepLog*) self;
+
+    int errorCode = nbsStepLogAppend(stepLog, stepId, stepLog->time, payload, octetCount);
+    if (errorCode < 0) {
+        NBS_LOG_C_WARN(&stepLog->log, "could not append step %08X to step log %d", stepId, errorCode)
+    }
+}
+
+/// Closes the log. The last segment file is truncated to the octets used.
+/// @param self step log
+/// @return negative on error
+int nbsStepLogClose(NbsStepLog* self)
+{
+    if (!self->isOpen) {
+        return NimbleStepErrNotOpen;
+    }
+
+    nbsStepLogSegmentUnmap(&self->segment, self->writeOffset);
+    self->isOpen = false;
+
+    return 0;
+}
+
+static int nbsStepLogReaderMapSegment(NbsStepLogReader* self, size_t segmentIndex, NbsStepLogSegmentHeader* header)
+{
+    char path[NBS_STEP_LOG_MAX_SEGMENT_PATH_LENGTH];
+    nbsStepLogSegmentPath(path, sizeof(path), self->basePath, segmentIndex);
+
+    int errorCode = nbsStepLogSegmentMap(&self->segment, path, segmentIndex, 0);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    tc_memcpy_octets(header, self->segment.octets, sizeof(*header));
+    if (header->magic != NBS_STEP_LOG_MAGIC || header->version != NBS_STEP_LOG_VERSION ||
+        nbsStepLogDataOffset(header->stepCapacity) > self->segment.octetCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "'%s' is not a step log segment", path)
+        nbsStepLogSegmentUnmap(&self->segment, 0);
+        return NimbleStepErrCorrupt;
+    }
+
+    return 0;
+}
+
+/// Opens a step log for random access reading
+/// @param self step log reader
+/// @param basePath the path used when the step log was created
+/// @param log the log to use
+/// @return negative on error
+int nbsStepLogReaderOpen(NbsStepLogReader* self, const char* basePath, Clog log)
+{
+    tc_mem_clear_type(self);
+    self->log = log;
+
+    size_t pathLength = strlen(basePath);
+    if (pathLength >= NBS_STEP_LOG_MAX_PATH_LENGTH) {
+        CLOG_C_SOFT_ERROR(&self->log, "step log path is too long")
+        return NimbleStepErrTargetTooSmall;
+    }
+    tc_memcpy_octets(self->basePath, basePath, pathLength + 1);
+
+    NbsStepLogSegmentHeader header;
+    int errorCode = nbsStepLogReaderMapSegment(self, 0, &header);
+    if (errorCode < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not open step log '%s' %d", basePath, errorCode)
+        return errorCode;
+    }
+
+    self->firstStepId = header.firstStepId;
+    self->stepCapacityPerSegment = header.stepCapacity;
+    self->isOpen = true;
+
+    return 0;
+}
+
+/// Finds a step in the log. Only the segment holding the step is mapped.
+/// @param self step log reader
+/// @param stepId the step to read
+/// @param record set to the step. The payload points into the mapped segment and is valid until the next read.
+/// @return octet count of the step, or negative if not found or on error
+int nbsStepLogReaderRead(NbsStepLogReader* self, StepId stepId, NbsStepLogRecord* record)
+{
+    if (!self->isOpen) {
+        return NimbleStepErrNotOpen;
+    }
+
+    if (stepId < self->firstStepId) {
+        return NimbleStepErrStepNotFound;
+    }
+
+    size_t stepIndex = stepId - self->firstStepId;
+    size_t segmentIndex = stepIndex / self->stepCapacityPerSegment;
+
+    NbsStepLogSegmentHeader header;
+    if (segmentIndex != self->segment.index || self->segment.octets == 0) {
+        nbsStepLogSegmentUnmap(&self->segment, 0);
+        int errorCode = nbsStepLogReaderMapSegment(self, segmentIndex, &header);
+        if (errorCode < 0) {
+            return NimbleStepErrStepNotFound;
+        }
+    } else {
+        tc_memcpy_octets(&header, self->segment.octets, sizeof(header));
+    }
+
+    size_t slot = stepIndex % self->stepCapacityPerSegment;
+    uint32_t stepCount = nbsAtomicLoadAcquireU32(&((const NbsStepLogSegmentHeader*) self->segment.octets)->stepCount);
+    if (slot >= stepCount) {
+        return NimbleStepErrStepNotFound;
+    }
+
+    const uint8_t* octets = self->segment.octets;
+    uint32_t recordOffset;
+    tc_memcpy_octets(&recordOffset, octets + sizeof(NbsStepLogSegmentHeader) + slot * sizeof(uint32_t),
+                     sizeof(recordOffset));
+    if ((size_t) recordOffset + NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT > self->segment.octetCount) {
+        return NimbleStepErrCorrupt;
+    }
+
+    const uint8_t* source = octets + recordOffset;
+    uint32_t recordStepId;
+    uint32_t recordOctetCount;
+    tc_memcpy_octets(&recordStepId, source, sizeof(recordStepId));
+    tc_memcpy_octets(&recordOctetCount, source + 4, sizeof(recordOctetCount));
+    tc_memcpy_octets(&record->time, source + 8, sizeof(record->time));
+
+    if (recordStepId != stepId ||
+        (size_t) recordOffset + NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT + recordOctetCount > self->segment.octetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "step log record for %08X is corrupt", stepId)
+        return NimbleStepErrCorrupt;
+    }
+
+    const uint8_t* payload = source + NBS_STEP_LOG_RECORD_HEADER_OCTET_COUNT;
+    uint32_t checksum;
+    tc_memcpy_octets(&checksum, source + 16, sizeof(checksum));
+    if (checksum != mashMurmurHash3(payload, recordOctetCount)) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "step log record for %08X has wrong checksum", stepId)
+        return NimbleStepErrCorrupt;
+    }
+
+    record->stepId = stepId;
+    record->payload = payload;
+    record->octetCount = recordOctetCount;
+
+    return (int) recordOctetCount;
+}
+
+/// Closes the step log reader
+/// @param self step log reader
+void nbsStepLogReaderClose(NbsStepLogReader* self)
+{
+    nbsStepLogSegmentUnmap(&self->segment, 0);
+    self->isOpen = false;
+}
@@ -2,8 +2,13 @@
  *  Copyright (c) Peter Bjorklund. All rights reserved.
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------*/
+#include "bit_scan.h"
+#include "nbs_atomic.h"
+#include "nbs_log.h"
 #include <clog/clog.h>
 #include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <imprint/allocator.h>
 #include <mash/murmur.h>
 #include <nimble-steps/steps.h>
 #include <stdbool.h>
@@ -16,13 +21,60 @@ int nbsStepsVerifyStep(const uint8_t* payload, size_t octetCount)
 {
     (void) payload;
     if (octetCount < NimbleStepMinimumSingleStepOctetCount) {
-        CLOG_SOFT_ERROR("combined step is too small")
-        return -1;
+        return NimbleStepErrMalformedStep;
     }
 
     return 0;
 }
 
+// The stats are only written by the thread that owns the steps. Release stores let a monitoring thread read each
+// counter without locks or read-modify-write instructions.
+static inline void nbsStepsStatsAdd(size_t* counter, size_t count)
+{
+    nbsAtomicStoreRelease(counter, *counter + count);
+}
+
+static void nbsStepsStatsWritten(NbsSteps* self, size_t octetCount)
+{
+    NbsStepsStats* stats = self->stats;
+    if (!stats) {
+        return;
+    }
+
+    nbsStepsStatsAdd(&stats->writeCount, 1);
+    size_t bucket = octetCount == 0 ? 0 : 64u - nbsCountLeadingZeros64(octetCount);
+    if (bucket >= NBS_STEPS_STATS_OCTET_BUCKET_COUNT) {
+        bucket = NBS_STEPS_STATS_OCTET_BUCKET_COUNT - 1;
+    }
+    nbsStepsStatsAdd(&stats->octetCountHistogram[bucket], 1);
+    if (self->stepsCount > stats->peakStepCount) {
+        nbsAtomicStoreRelease(&stats->peakStepCount, self->stepsCount);
+    }
+}
+
+static void nbsStepsStatsDropped(NbsSteps* self, size_t stepCount)
+{
+    if (self->stats) {
+        nbsStepsStatsAdd(&self->stats->droppedCount, stepCount);
+    }
+}
+
+static void nbsStepsStatsWrongStepId(NbsSteps* self, StepId stepId)
+{
+    NbsStepsStats* stats = self->stats;
+    if (!stats) {
+        return;
+    }
+
+    // Compare the distance instead of the ids, so it also works when the StepId wraps around
+    StepId distanceBehind = self->expectedWriteId - stepId;
+    if (distanceBehind < 0x80000000u) {
+        nbsStepsStatsAdd(&stats->lateCount, 1);
+    } else {
+        nbsStepsStatsAdd(&stats->outOfOrderCount, 1);
+    }
+}
+
 /// Clears the buffer and sets a new starting TickId
 /// @param self steps
 /// @param initialId starting tickId for the buffer. The next write must be exactly for this TickId.
@@ -33,6 +85,18 @@ void nbsStepsReInit(NbsSteps* self, StepId initialId)
     self->expectedReadId = initialId;
     self->infoHeadIndex = 0;
     self->infoTailIndex = 0;
+    self->waitCounter = 0;
+    self->reservedOctetCount = 0;
+    self->tailPrefixHash = 0;
+    self->headPrefixHash = 0;
+    self->headTime = 0;
+    self->hasHeadTime = false;
+    self->isRetaining = false;
+    self->hasCursorKeptStep = false;
+    for (size_t i = 0; i < NBS_STEPS_MAX_CURSOR_COUNT; ++i) {
+        self->cursorReadIds[i] = initialId;
+    }
+    nbsStepsResetArrivalStats(self);
     self->isInitialized = true;
     discoidBufferReset(&self->stepsData);
 }
@@ -54,6 +118,20 @@ void nbsStepsReset(NbsSteps* self)
 /// @param maxOctetSizeForCombinedStep maximum number of octets for each combined step
 /// @param log the log to use
 void nbsStepsInit(NbsSteps* self, struct ImprintAllocator* allocator, size_t maxOctetSizeForCombinedStep, Clog log)
+{
+    nbsStepsInitWithWindowSize(self, allocator, maxOctetSizeForCombinedStep, NBS_WINDOW_SIZE, log);
+}
+
+/// Initializes the steps buffer with a specific window size and allocates all memory needed
+/// At most half of the window can be filled with steps. A power of two window size is slightly faster to index.
+/// @note you must call nbsStepsReInit directly after a call to this function
+/// @param self steps
+/// @param allocator allocator to use for step allocation
+/// @param maxOctetSizeForCombinedStep maximum number of octets for each combined step
+/// @param windowSize number of step infos in the window, must be at least four
+/// @param log the log to use
+void nbsStepsInitWithWindowSize(NbsSteps* self, struct ImprintAllocator* allocator, size_t maxOctetSizeForCombinedStep,
+                                size_t windowSize, Clog log)
 {
     tc_mem_clear_type(self);
     self->log = log;
@@ -63,46 +141,180 @@ void nbsStepsInit(NbsSteps* self, struct ImprintAllocator* allocator, size_t max
                      NimbleStepMaxCombinedStepOctetCount, maxOctetSizeForCombinedStep)
     }
 
-    size_t bufferOctetSize = maxOctetSizeForCombinedStep * (NBS_WINDOW_SIZE / 2);
+    if (windowSize < 4) {
+        CLOG_C_ERROR(&self->log, "nbsStepsInit: window size must be at least four, but encountered %zu", windowSize)
+    }
+
+    self->windowSize = windowSize;
+    self->targetDepth = windowSize / 4;
+    self->maxStepOctetCount = maxOctetSizeForCombinedStep;
+    self->windowIndexMask = (windowSize & (windowSize - 1)) == 0 ? windowSize - 1 : 0;
+    self->infos = IMPRINT_ALLOC_TYPE_COUNT(allocator, StepInfo, windowSize);
+    self->times = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint64_t, windowSize);
+    self->prefixHashes = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint64_t, windowSize);
+
+    size_t bufferOctetSize = maxOctetSizeForCombinedStep * (windowSize / 2);
+    if (bufferOctetSize > UINT32_MAX) {
+        CLOG_C_ERROR(&self->log, "nbsStepsInit: buffer of %zu octets is too big for the step infos", bufferOctetSize)
+    }
     discoidBufferInit(&self->stepsData, allocator, bufferOctetSize);
 }
 
+/// Calculates the number of octets that nbsStepsInitWithWindowSize allocates
+/// @param maxOctetSizeForCombinedStep maximum number of octets for each combined step
+/// @param windowSize number of step infos in the window
+/// @return octet count
+size_t nbsStepsFootprint(size_t maxOctetSizeForCombinedStep, size_t windowSize)
+{
+    return (sizeof(StepInfo) + 2 * sizeof(uint64_t)) * windowSize + maxOctetSizeForCombinedStep * (windowSize / 2);
+}
+
 /// Checks if it is possible to write to the buffer
 /// @param self steps
-/// @return true if possible, false otherwise
+/// @return true if fewer steps than the target depth are stored, false otherwise
 bool nbsStepsAllowedToAdd(const NbsSteps* self)
 {
-    return self->stepsCount < NBS_WINDOW_SIZE / 4;
+    return self->stepsCount < self->targetDepth;
 }
 
-#define NBS_ADVANCE(index) index = (index + 1) % NBS_WINDOW_SIZE
-// #define NBS_RETREAT(index) index = tc_modulo((index - 1),  NBS_WINDOW_SIZE)
+/// Sets how many steps should be buffered, see nbsStepsAllowedToAdd. Defaults to a quarter of the window.
+/// @param self steps
+/// @param targetDepth number of steps, clamped between one and half the window
+void nbsStepsSetTargetDepth(NbsSteps* self, size_t targetDepth)
+{
+    if (targetDepth < 1) {
+        targetDepth = 1;
+    } else if (targetDepth > self->windowSize / 2) {
+        targetDepth = self->windowSize / 2;
+    }
+
+    self->targetDepth = targetDepth;
+}
+
+static inline size_t nbsStepsWrapIndex(const NbsSteps* self, size_t index)
+{
+    return self->windowIndexMask != 0 ? index & self->windowIndexMask : index % self->windowSize;
+}
+
+static uint64_t nbsStepsStepHash(StepId stepId, const uint8_t* payload, size_t octetCount)
+{
+    // The StepId is part of the hash, so the same payloads in a different order give a different range hash
+    uint64_t hash = ((uint64_t) mashMurmurHash3(payload, octetCount) << 32) | stepId;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static void nbsStepsUpdateRangeHash(NbsSteps* self, size_t infoIndex, StepId stepId, const uint8_t* payload,
+                                    size_t octetCount)
+{
+    self->headPrefixHash += nbsStepsStepHash(stepId, payload, octetCount);
+    self->prefixHashes[infoIndex] = self->headPrefixHash;
+}
+
+/// A reserved step is never split at the end of the buffer, so there can be unused octets in front of it
+static int nbsStepsSkipPaddingBeforeInfo(NbsSteps* self, const StepInfo* info)
+{
+    size_t capacity = self->stepsData.capacity;
+    size_t paddingOctetCount = (info->positionInBuffer + capacity - self->stepsData.readIndex) % capacity;
+    if (paddingOctetCount == 0) {
+        return 0;
+    }
+
+    return discoidBufferSkip(&self->stepsData, paddingOctetCount);
+}
+
+/// Number of steps that have been read or discarded, but are kept for nbsStepsRestore
+static size_t nbsStepsRetainedCount(const NbsSteps* self)
+{
+    if (!self->isRetaining) {
+        return 0;
+    }
+
+    return self->expectedReadId - self->retained.readId;
+}
+
+static size_t nbsStepsRetainedOctetCount(const NbsSteps* self)
+{
+    if (nbsStepsRetainedCount(self) == 0) {
+        return 0;
+    }
+
+    // Every step has at least one octet, so no distance means that the retained steps use the whole buffer
+    size_t capacity = self->stepsData.capacity;
+    size_t octetCount = (self->stepsData.readIndex + capacity - self->retained.readIndex) % capacity;
+
+    return octetCount == 0 ? capacity : octetCount;
+}
+
+/// Octets of the last step discarded by nbsStepsCursorRead, that are kept so the cursor views of it stay valid
+static size_t nbsStepsCursorKeptOctetCount(const NbsSteps* self)
+{
+    if (!self->hasCursorKeptStep) {
+        return 0;
+    }
+
+    size_t capacity = self->stepsData.capacity;
+    size_t octetCount = (self->stepsData.readIndex + capacity - self->cursorKeptPosition) % capacity;
+
+    return octetCount == 0 ? capacity : octetCount;
+}
+
+/// Octets that can be written without overwriting stored, retained or cursor kept steps
+static size_t nbsStepsWriteAvailable(const NbsSteps* self)
+{
+    size_t keptOctetCount = nbsStepsRetainedOctetCount(self);
+    size_t cursorKeptOctetCount = nbsStepsCursorKeptOctetCount(self);
+    if (cursorKeptOctetCount > keptOctetCount) {
+        keptOctetCount = cursorKeptOctetCount;
+    }
+
+    return discoidBufferWriteAvailable(&self->stepsData) - keptOctetCount;
+}
+
+/// Checks if there is room to write one more step, taking the retained steps into account
+/// @param self steps
+/// @param octetCount octet count of the step
+/// @return true if nbsStepsWrite will not fail with NimbleStepErrBufferFull
+bool nbsStepsHasRoomFor(const NbsSteps* self, size_t octetCount)
+{
+    return self->stepsCount + nbsStepsRetainedCount(self) < self->windowSize / 2 &&
+           nbsStepsWriteAvailable(self) >= octetCount;
+}
 
 static int advanceInfoTail(NbsSteps* self, const StepInfo** outInfo)
 {
-    const StepInfo* info = &self->infos[self->infoTailIndex];
-    NBS_ADVANCE(self->infoTailIndex);
+    if (self->stepsCount == 0) {
+        return NimbleStepErrCollectionIsEmpty;
+    }
 
-    if (info->stepId != self->expectedReadId) {
-        CLOG_C_ERROR(&self->log, "expected to read %u but encountered %u", self->expectedReadId, info->stepId)
-        //*outInfo = 0;
-        // return -3;
+    const StepInfo* info = &self->infos[self->infoTailIndex];
+    if (self->isRangeHashEnabled) {
+        self->tailPrefixHash = self->prefixHashes[self->infoTailIndex];
     }
+    self->infoTailIndex = nbsStepsWrapIndex(self, self->infoTailIndex + 1);
+
     self->expectedReadId++;
     self->stepsCount--;
+    self->hasCursorKeptStep = false;
 
     *outInfo = info;
     return 0;
 }
 
-static int nbsStepsReadHelper(NbsSteps* self, const StepInfo* info, uint8_t* data, size_t maxTarget)
+static int nbsStepsReadHelper(NbsSteps* self, const StepInfo* info, uint8_t* data)
 {
-    if (info->octetCount > maxTarget) {
-        CLOG_C_ERROR(&self->log, "wrong octet count in steps data")
-        // return -3;
+    int errorCode = nbsStepsSkipPaddingBeforeInfo(self, info);
+    if (errorCode < 0) {
+        return errorCode;
     }
 
-    int errorCode = discoidBufferRead(&self->stepsData, data, info->octetCount);
+    errorCode = discoidBufferRead(&self->stepsData, data, info->octetCount);
     if (errorCode < 0) {
         return errorCode;
     }
@@ -122,16 +334,27 @@ int nbsStepsRead(NbsSteps* self, StepId* stepId, uint8_t* data, size_t maxTarget
         return NimbleStepErrCollectionIsEmpty;
     }
 
+    // Check before the tail is advanced, so a too small target does not lose the step
+    size_t octetCount = self->infos[self->infoTailIndex].octetCount;
+    if (octetCount > maxTarget) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "read: target buffer is too small %zu %zu", octetCount, maxTarget)
+        return NimbleStepErrTargetTooSmall;
+    }
+
     const StepInfo* info;
 
+    *stepId = self->expectedReadId;
+
     int errorCode = advanceInfoTail(self, &info);
     if (errorCode < 0) {
         return errorCode;
     }
 
-    *stepId = info->stepId;
+    if (self->stats) {
+        nbsStepsStatsAdd(&self->stats->readCount, 1);
+    }
 
-    return nbsStepsReadHelper(self, info, data, maxTarget);
+    return nbsStepsReadHelper(self, info, data);
 }
 
 /// Reads the exact step Id. Discards old steps if any.
@@ -150,23 +373,20 @@ int nbsStepsReadExactStepId(NbsSteps* self, StepId needStepId, uint8_t* data, si
 
     int readStepOctetCount = nbsStepsRead(self, &encounteredStepId, data, maxTarget);
 
-    // CLOG_VERBOSE("authenticate: party %d, found step:%08X, octet count: %d",participant->inParty->id,
-    // encounteredStepId, stepOctetCount);
-
     if (readStepOctetCount < 0) {
-        CLOG_C_SOFT_ERROR(&self->log, "couldn't find exact step %08X error:%d", needStepId, readStepOctetCount)
+        NBS_LOG_C_SOFT_ERROR(&self->log, "couldn't find exact step %08X error:%d", needStepId, readStepOctetCount)
         return readStepOctetCount;
     }
 
     if (encounteredStepId != needStepId) {
-        CLOG_C_VERBOSE(&self->log,
-                       "buffer could not provide the ID the caller was looking for. needed %08X, but got %08X",
-                       needStepId, encounteredStepId)
+        NBS_LOG_C_VERBOSE(&self->log,
+                          "buffer could not provide the ID the caller was looking for. needed %08X, but got %08X",
+                          needStepId, encounteredStepId)
         int discardErr = nbsStepsDiscardUpTo(self, needStepId + 1);
         if (discardErr < 0) {
-            CLOG_C_ERROR(&self->log, "could not discard including %d", discardErr)
+            return discardErr;
         }
-        return -1;
+        return NimbleStepErrStepNotFound;
     }
 
     return readStepOctetCount;
@@ -175,22 +395,20 @@ int nbsStepsReadExactStepId(NbsSteps* self, StepId needStepId, uint8_t* data, si
 /// Gets an index for a specific tickId (stepId)
 /// @param self steps
 /// @param stepId id to get the index fo
-/// @return negative if stepId is not found
+/// @return NimbleStepErrCollectionIsEmpty or NimbleStepErrStepNotFound if stepId is not found
 int nbsStepsGetIndexForStep(const NbsSteps* self, StepId stepId)
 {
     if (self->stepsCount == 0) {
-        CLOG_C_WARN(&self->log, "read at steps: no steps stored")
-        return -2;
+        return NimbleStepErrCollectionIsEmpty;
     }
 
-    for (size_t i = 0U; i < self->stepsCount; ++i) {
-        int infoIndex = tc_modulo((int) (self->infoTailIndex + i), NBS_WINDOW_SIZE);
-        const StepInfo* info = &self->infos[infoIndex];
-        if (info->stepId == stepId) {
-            return infoIndex;
-        }
+    // Steps are stored contiguously without gaps, so the distance from the tail is the offset in the window
+    StepId distanceFromTail = stepId - self->expectedReadId;
+    if (distanceFromTail >= self->stepsCount) {
+        return NimbleStepErrStepNotFound;
     }
-    return -1;
+
+    return (int) nbsStepsWrapIndex(self, self->infoTailIndex + distanceFromTail);
 }
 
 /// Reads a step at the specified index
@@ -201,30 +419,110 @@ int nbsStepsGetIndexForStep(const NbsSteps* self, StepId stepId)
 /// @return negative on error
 int nbsStepsReadAtIndex(const NbsSteps* self, int infoIndex, uint8_t* data, size_t maxTarget)
 {
-    if (infoIndex < 0) {
-        return -2;
-    }
-    if (infoIndex >= NBS_WINDOW_SIZE) {
-        return -3;
+    if (infoIndex < 0 || (size_t) infoIndex >= self->windowSize) {
+        return NimbleStepErrIndexOutOfRange;
     }
 
     const StepInfo* info = &self->infos[infoIndex];
     if (info->octetCount > maxTarget) {
-        CLOG_C_WARN(&self->log, "read at steps: target buffer is too small %zu %zu", info->octetCount, maxTarget)
-        return -5;
+        NBS_LOG_C_WARN(&self->log, "read at steps: target buffer is too small %zu %zu", (size_t) info->octetCount,
+                       maxTarget)
+        return NimbleStepErrTargetTooSmall;
     }
 
     discoidBufferPeek(&self->stepsData, info->positionInBuffer, data, info->octetCount);
 
     int verifyError = nbsStepsVerifyStep(data, info->octetCount);
     if (verifyError < 0) {
-        CLOG_C_SOFT_ERROR(&self->log, "wrong step stored in discoid buffer")
+        NBS_LOG_C_SOFT_ERROR(&self->log, "wrong step stored in discoid buffer")
         return verifyError;
     }
 
     return (int) info->octetCount;
 }
 
+static void nbsStepsFillView(const NbsSteps* self, const StepInfo* info, StepId stepId, NbsStepView* view)
+{
+    const DiscoidBuffer* buffer = &self->stepsData;
+    size_t octetCountUntilEnd = buffer->capacity - info->positionInBuffer;
+
+    view->stepId = stepId;
+    view->first.payload = buffer->buffer + info->positionInBuffer;
+
+    if (info->octetCount <= octetCountUntilEnd) {
+        view->first.octetCount = info->octetCount;
+        view->second.payload = 0;
+        view->second.octetCount = 0;
+    } else {
+        view->first.octetCount = octetCountUntilEnd;
+        view->second.payload = buffer->buffer;
+        view->second.octetCount = info->octetCount - octetCountUntilEnd;
+    }
+}
+
+/// Gets a zero-copy view of the step at the specified index
+/// The view points into the buffer and is only valid until the step is discarded.
+/// @param self steps
+/// @param infoIndex index of info
+/// @param view the view to fill out
+/// @return total octet count of the step, or negative on error
+int nbsStepsViewAtIndex(const NbsSteps* self, int infoIndex, NbsStepView* view)
+{
+    if (infoIndex < 0 || (size_t) infoIndex >= self->windowSize) {
+        return NimbleStepErrIndexOutOfRange;
+    }
+
+    const StepInfo* info = &self->infos[infoIndex];
+    size_t distanceFromTail = nbsStepsWrapIndex(self, (size_t) infoIndex + self->windowSize - self->infoTailIndex);
+    nbsStepsFillView(self, info, self->expectedReadId + (StepId) distanceFromTail, view);
+
+    return (int) info->octetCount;
+}
+
+/// Gets a zero-copy view of the next step to read, without reading it.
+/// The view points into the buffer and is only valid until the step is discarded.
+/// @param self steps
+/// @param view the view to fill out
+/// @return total octet count of the step, or negative on error
+int nbsStepsPeekView(const NbsSteps* self, NbsStepView* view)
+{
+    if (self->stepsCount == 0) {
+        return NimbleStepErrCollectionIsEmpty;
+    }
+
+    const StepInfo* info = &self->infos[self->infoTailIndex];
+    nbsStepsFillView(self, info, self->expectedReadId, view);
+
+    return (int) info->octetCount;
+}
+
+/// Gets a zero-copy view of the exact step Id. Discards older steps if any, but not the step itself.
+/// The view points into the buffer and is only valid until the step is discarded.
+/// @param self steps
+/// @param stepId the exact stepId to view
+/// @param view the view to fill out
+/// @return total octet count of the step, or negative on error
+int nbsStepsViewExactStepId(NbsSteps* self, StepId stepId, NbsStepView* view)
+{
+    int discardErr = nbsStepsDiscardUpTo(self, stepId);
+    if (discardErr < 0) {
+        return discardErr;
+    }
+
+    if (self->stepsCount == 0) {
+        return NimbleStepErrCollectionIsEmpty;
+    }
+
+    if (self->expectedReadId != stepId) {
+        NBS_LOG_C_VERBOSE(&self->log,
+                          "buffer could not provide the ID the caller was looking for. needed %08X, but got %08X",
+                          stepId, self->expectedReadId)
+        return NimbleStepErrStepNotFound;
+    }
+
+    return nbsStepsPeekView(self, view);
+}
+
 /// Discard one step
 /// @param self steps
 /// @param stepId fills out the TickId for the step
@@ -233,16 +531,53 @@ int nbsStepsDiscard(struct NbsSteps* self, StepId* stepId)
 {
     const StepInfo* info;
 
+    *stepId = self->expectedReadId;
+
     int errorCode = advanceInfoTail(self, &info);
     if (errorCode < 0) {
-        CLOG_C_SOFT_ERROR(&self->log, "couldn't advance tail")
         return errorCode;
     }
-    *stepId = info->stepId;
+
+    errorCode = nbsStepsSkipPaddingBeforeInfo(self, info);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    if (self->stats) {
+        nbsStepsStatsAdd(&self->stats->discardCount, 1);
+    }
 
     return discoidBufferSkip(&self->stepsData, info->octetCount);
 }
 
+static int nbsStepsDiscardMultiple(NbsSteps* self, size_t discardCount)
+{
+    if (discardCount == 0) {
+        return 0;
+    }
+
+    size_t newTailIndex = nbsStepsWrapIndex(self, self->infoTailIndex + discardCount);
+    if (self->isRangeHashEnabled) {
+        self->tailPrefixHash = self->prefixHashes[nbsStepsWrapIndex(self, newTailIndex + self->windowSize - 1)];
+    }
+    size_t octetCountToSkip;
+    if (discardCount == self->stepsCount) {
+        octetCountToSkip = self->stepsData.size;
+    } else {
+        // The payloads are stored back to back, so the distance to the first kept step is the total skip
+        size_t capacity = self->stepsData.capacity;
+        octetCountToSkip = (self->infos[newTailIndex].positionInBuffer + capacity - self->stepsData.readIndex) %
+                           capacity;
+    }
+
+    self->infoTailIndex = newTailIndex;
+    self->expectedReadId += (StepId) discardCount;
+    self->stepsCount -= discardCount;
+    self->hasCursorKeptStep = false;
+
+    return discoidBufferSkip(&self->stepsData, octetCountToSkip);
+}
+
 /// Discards up to, but not including the specified TickId.
 /// @param self steps
 /// @param stepIdToDiscardTo discard up to, but not including this StepId
@@ -255,109 +590,814 @@ int nbsStepsDiscardUpTo(NbsSteps* self, StepId stepIdToDiscardTo)
 
     if (stepIdToDiscardTo <= self->expectedReadId) {
         if (stepIdToDiscardTo < self->expectedReadId) {
-            CLOG_C_WARN(&self->log, "nbsStepsDiscardUpTo: this happened a while back: %08X vs our start %08X",
-                        stepIdToDiscardTo, self->expectedReadId)
+            NBS_LOG_C_WARN(&self->log, "nbsStepsDiscardUpTo: this happened a while back: %08X vs our start %08X",
+                           stepIdToDiscardTo, self->expectedReadId)
         }
         return 0;
     }
 
-    size_t discardedCount = 0;
-    while (1) {
-        StepId discardedStepId;
-        if (self->expectedReadId == stepIdToDiscardTo) {
-            break;
-        }
-        if (self->stepsCount == 0) {
-            break;
-        }
-        int errorCode = nbsStepsDiscard(self, &discardedStepId);
-        if (errorCode < 0) {
-            return errorCode;
-        }
-        discardedCount++;
+    size_t discardCount = stepIdToDiscardTo - self->expectedReadId;
+    if (discardCount > self->stepsCount) {
+        discardCount = self->stepsCount;
+    }
+
+    int errorCode = nbsStepsDiscardMultiple(self, discardCount);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    if (self->stats) {
+        nbsStepsStatsAdd(&self->stats->discardCount, discardCount);
     }
 
-    return (int) discardedCount;
+    return (int) discardCount;
 }
 
 /// Discards a number of steps from the buffer
 /// @param self steps
 /// @param stepCountToDiscard number of steps to discard
-/// @return negative on error.
+/// @return NimbleStepErrTooManyToDiscard if there are fewer steps stored, and then nothing is discarded
 int nbsStepsDiscardCount(NbsSteps* self, size_t stepCountToDiscard)
 {
     if (self->stepsCount < stepCountToDiscard) {
-        CLOG_C_ERROR(&self->log, "too many to discard")
-        // return -99;
+        NBS_LOG_C_SOFT_ERROR(&self->log, "can not discard %zu steps, only %zu stored", stepCountToDiscard,
+                             self->stepsCount)
+        return NimbleStepErrTooManyToDiscard;
+    }
+
+    int errorCode = nbsStepsDiscardMultiple(self, stepCountToDiscard);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    if (self->stats) {
+        nbsStepsStatsAdd(&self->stats->discardCount, stepCountToDiscard);
+    }
+
+    return 0;
+}
+
+/// Distance from the tail to the next step for the cursor. Cursors left behind by a discard are at the tail.
+static bool nbsStepsIsCursor(const NbsSteps* self, int cursorIndex)
+{
+    return cursorIndex >= 0 && cursorIndex < NBS_STEPS_MAX_CURSOR_COUNT && (self->cursorMask & (1u << cursorIndex));
+}
+
+static size_t nbsStepsCursorDistance(const NbsSteps* self, int cursorIndex)
+{
+    size_t distance = self->cursorReadIds[cursorIndex] - self->expectedReadId;
+
+    return distance > self->stepsCount ? 0 : distance;
+}
+
+/// Registers a read cursor that starts after the steps that the registered cursors have read
+/// Each cursor reads all steps on its own. A step is discarded when every cursor has read it, so while cursors
+/// are registered, steps should only be consumed through them.
+/// @param self steps
+/// @return cursor index, or NimbleStepErrNoFreeCursor
+int nbsStepsCursorAdd(NbsSteps* self)
+{
+    uint32_t freeMask = ~self->cursorMask & ((1u << NBS_STEPS_MAX_CURSOR_COUNT) - 1);
+    if (freeMask == 0) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "all %d read cursors are in use", NBS_STEPS_MAX_CURSOR_COUNT)
+        return NimbleStepErrNoFreeCursor;
+    }
+
+    // A step that another cursor has read is not read again by a cursor added after it
+    size_t furthestDistance = 0;
+    uint32_t mask = self->cursorMask;
+    while (mask != 0) {
+        int otherIndex = (int) nbsCountTrailingZeros64(mask);
+        mask &= mask - 1;
+        size_t otherDistance = nbsStepsCursorDistance(self, otherIndex);
+        if (otherDistance > furthestDistance) {
+            furthestDistance = otherDistance;
+        }
+    }
+
+    int cursorIndex = (int) nbsCountTrailingZeros64(freeMask);
+    self->cursorMask |= 1u << cursorIndex;
+    self->cursorReadIds[cursorIndex] = self->expectedReadId + (StepId) furthestDistance;
+
+    return cursorIndex;
+}
+
+/// Unregisters a read cursor. Steps that only this cursor had left to read are not discarded until the next read.
+/// @param self steps
+/// @param cursorIndex cursor from nbsStepsCursorAdd, other values are ignored
+void nbsStepsCursorRemove(NbsSteps* self, int cursorIndex)
+{
+    if (!nbsStepsIsCursor(self, cursorIndex)) {
+        return;
     }
 
-    for (size_t i = 0; i < stepCountToDiscard; ++i) {
-        StepId discardedStepId;
-        int errorCode = nbsStepsDiscard(self, &discardedStepId);
+    self->cursorMask &= ~(1u << cursorIndex);
+}
+
+/// Gets the number of steps the cursor has left to read
+/// @param self steps
+/// @param cursorIndex cursor from nbsStepsCursorAdd
+/// @return number of steps, zero if cursorIndex is not a registered cursor
+size_t nbsStepsCursorCount(const NbsSteps* self, int cursorIndex)
+{
+    if (!nbsStepsIsCursor(self, cursorIndex)) {
+        return 0;
+    }
+
+    return self->stepsCount - nbsStepsCursorDistance(self, cursorIndex);
+}
+
+/// Gets a zero-copy view of the next step for the cursor and moves the cursor past it
+/// The view stays valid until the same cursor reads again. The steps that all cursors have passed are discarded.
+/// @param self steps
+/// @param cursorIndex cursor from nbsStepsCursorAdd
+/// @param view the view to fill out
+/// @return total octet count of the step, NimbleStepErrCollectionIsEmpty if the cursor has read all steps or
+/// NimbleStepErrIndexOutOfRange if cursorIndex is not a registered cursor
+int nbsStepsCursorRead(NbsSteps* self, int cursorIndex, NbsStepView* view)
+{
+    if (!nbsStepsIsCursor(self, cursorIndex)) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "read cursor %d is not registered", cursorIndex)
+        return NimbleStepErrIndexOutOfRange;
+    }
+
+    size_t distance = nbsStepsCursorDistance(self, cursorIndex);
+    if (distance == self->stepsCount) {
+        return NimbleStepErrCollectionIsEmpty;
+    }
+
+    const StepInfo* info = &self->infos[nbsStepsWrapIndex(self, self->infoTailIndex + distance)];
+    int octetCount = (int) info->octetCount;
+    nbsStepsFillView(self, info, self->expectedReadId + (StepId) distance, view);
+    self->cursorReadIds[cursorIndex] = view->stepId + 1;
+    if (self->stats) {
+        nbsStepsStatsAdd(&self->stats->readCount, 1);
+    }
+
+    size_t slowestDistance = distance + 1;
+    uint32_t mask = self->cursorMask;
+    while (mask != 0) {
+        int otherIndex = (int) nbsCountTrailingZeros64(mask);
+        mask &= mask - 1;
+        size_t otherDistance = nbsStepsCursorDistance(self, otherIndex);
+        if (otherDistance < slowestDistance) {
+            slowestDistance = otherDistance;
+        }
+    }
+
+    if (slowestDistance > 0) {
+        // The octets of the last discarded step are kept until the next discard, so the views of it stay valid
+        size_t keptPosition = self->infos[nbsStepsWrapIndex(self, self->infoTailIndex + slowestDistance - 1)]
+                                  .positionInBuffer;
+        int errorCode = nbsStepsDiscardMultiple(self, slowestDistance);
         if (errorCode < 0) {
             return errorCode;
         }
+        self->cursorKeptPosition = keptPosition;
+        self->hasCursorKeptStep = true;
+    }
+
+    return octetCount;
+}
+
+/// Captures the current read position, so reading can be rewound to it with nbsStepsRestore
+/// Only the position is stored, the snapshot does not copy any step payloads.
+/// @param self steps
+/// @param snapshot the snapshot to fill out
+void nbsStepsSnapshot(const NbsSteps* self, NbsStepsSnapshot* snapshot)
+{
+    snapshot->readId = self->expectedReadId;
+    snapshot->infoTailIndex = self->infoTailIndex;
+    snapshot->readIndex = self->stepsData.readIndex;
+    snapshot->tailPrefixHash = self->tailPrefixHash;
+}
+
+/// Keeps the steps from the snapshot and onward in the buffer when they are read or discarded
+/// The retained steps use up room in the buffer until the retain point is moved forward or released.
+/// @param self steps
+/// @param snapshot must not be older than the current retain point, or than the read position if nothing is retained
+/// @return NimbleStepErrNotRetained if the steps in front of the snapshot are already gone
+int nbsStepsRetain(NbsSteps* self, const NbsStepsSnapshot* snapshot)
+{
+    if ((StepId) (self->expectedReadId - snapshot->readId) > nbsStepsRetainedCount(self)) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "can not retain from %08X, the oldest kept step is %08X", snapshot->readId,
+                             self->expectedReadId - (StepId) nbsStepsRetainedCount(self))
+        return NimbleStepErrNotRetained;
     }
 
+    self->retained = *snapshot;
+    self->isRetaining = true;
+
     return 0;
 }
 
+/// Stops retaining read steps, their room in the buffer can be written to again
+/// @param self steps
+void nbsStepsReleaseRetained(NbsSteps* self)
+{
+    self->isRetaining = false;
+}
+
+/// Rewinds reading to a snapshot, for example to replay steps after a rollback
+/// No payloads are copied, the tail is only moved back over the retained steps. Steps that were written after
+/// the snapshot was taken are kept, so replaying continues into them.
+/// @param self steps
+/// @param snapshot a snapshot taken at or after the retain point
+/// @return number of steps that were rewound, or NimbleStepErrNotRetained
+int nbsStepsRestore(NbsSteps* self, const NbsStepsSnapshot* snapshot)
+{
+    size_t rewindCount = self->expectedReadId - snapshot->readId;
+    if (rewindCount > nbsStepsRetainedCount(self)) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "can not restore to %08X, it is not retained", snapshot->readId)
+        return NimbleStepErrNotRetained;
+    }
+
+    if (rewindCount == 0) {
+        return 0;
+    }
+
+    DiscoidBuffer* buffer = &self->stepsData;
+    size_t capacity = buffer->capacity;
+    size_t rewindOctetCount = (buffer->readIndex + capacity - snapshot->readIndex) % capacity;
+    if (rewindOctetCount == 0) {
+        rewindOctetCount = capacity;
+    }
+
+    buffer->readIndex = snapshot->readIndex;
+    buffer->size += rewindOctetCount;
+
+    self->infoTailIndex = snapshot->infoTailIndex;
+    self->tailPrefixHash = snapshot->tailPrefixHash;
+    self->expectedReadId = snapshot->readId;
+    self->stepsCount += rewindCount;
+    self->hasCursorKeptStep = false;
+
+    return (int) rewindCount;
+}
+
 /// Writes a step to the buffer
 /// The stepId must be one more than the previous one inserted. The specified stepId is only used for debugging.
 /// @param self steps
 /// @param stepId only used for debugging, must be the expectedWriteId.
 /// @param data application specific step payload
-/// @param stepSize number of octets in data
+/// @param stepSize number of octets in data, at most the maximum step octet count set at init
 /// @return negative on error
 int nbsStepsWrite(NbsSteps* self, StepId stepId, const uint8_t* data, size_t stepSize)
 {
-    if (stepSize > 1024) {
-        CLOG_C_ERROR(&self->log, "wrong stuff in steps data")
-        // return -3;
+    if (self->reservedOctetCount != 0) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "can not write step %08X while a step is reserved", stepId)
+        return NimbleStepErrReservation;
     }
 
-    if (self->stepsCount == NBS_WINDOW_SIZE / 2) {
-        CLOG_C_ERROR(&self->log, "buffer is full. Do not know how to handle it. %zu out of %d", self->stepsCount,
-                     NBS_WINDOW_SIZE)
-        // return -6;
+    if (stepSize > self->maxStepOctetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "step %08X has wrong octet count %zu", stepId, stepSize)
+        return NimbleStepErrWrongOctetCount;
     }
 
     if (self->expectedWriteId != stepId) {
-        CLOG_C_ERROR(&self->log, "expected write %08X but got %08X", self->expectedWriteId, stepId)
-        // return -4;
+        NBS_LOG_C_SOFT_ERROR(&self->log, "expected write %08X but got %08X", self->expectedWriteId, stepId)
+        nbsStepsStatsWrongStepId(self, stepId);
+        return NimbleStepErrWrongStepId;
+    }
+
+    if (!nbsStepsHasRoomFor(self, stepSize)) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "buffer is full. %zu out of %zu", self->stepsCount, self->windowSize)
+        nbsStepsStatsDropped(self, 1);
+        return NimbleStepErrBufferFull;
     }
 
     int code = nbsStepsVerifyStep(data, stepSize);
     if (code < 0) {
-        CLOG_C_ERROR(&self->log, "not a correctly serialized step. can not add")
-        // return code;
+        NBS_LOG_C_SOFT_ERROR(&self->log, "not a correctly serialized step. can not add")
+        return code;
     }
 
     self->expectedWriteId++;
 
     StepInfo* info = &self->infos[self->infoHeadIndex];
-    info->stepId = stepId;
-    info->octetCount = stepSize;
-    info->positionInBuffer = self->stepsData.writeIndex;
-    // CLOG_C_VERBOSE(&self->log,
-    //              "nbsStepsWrite stepId: %08X infoHead: %zu pos: %zu "
-    //            "octetCount: %zu stored steps: %zu",
-    //          stepId, self->infoHeadIndex, info->positionInBuffer, info->octetCount, self->stepsCount + 1)
-    NBS_ADVANCE(self->infoHeadIndex);
+    info->octetCount = (uint16_t) stepSize;
+    info->positionInBuffer = (uint32_t) self->stepsData.writeIndex;
+    self->times[self->infoHeadIndex] = self->headTime;
+    self->infoHeadIndex = nbsStepsWrapIndex(self, self->infoHeadIndex + 1);
 
     int errorCode;
 
     errorCode = discoidBufferWrite(&self->stepsData, data, stepSize);
     if (errorCode < 0) {
-        CLOG_C_SOFT_ERROR(&self->log, "couldn't write to buffer %d", errorCode)
+        NBS_LOG_C_SOFT_ERROR(&self->log, "couldn't write to buffer %d", errorCode)
         return errorCode;
     }
 
     self->stepsCount++;
 
+    if (self->isRangeHashEnabled) {
+        nbsStepsUpdateRangeHash(self, (size_t) (info - self->infos), stepId, data, stepSize);
+    }
+
+    nbsStepsStatsWritten(self, stepSize);
+
+    if (self->writeListener) {
+        self->writeListener(self->writeListenerUserData, stepId, data, stepSize);
+    }
+
     return (int) stepSize;
 }
 
+static size_t nbsStepsArrivalBucket(uint64_t interval)
+{
+    if (interval < 4) {
+        return (size_t) interval;
+    }
+
+    size_t exponent = 63 - nbsCountLeadingZeros64(interval);
+    size_t subBucket = (size_t) (interval >> (exponent - 2)) & 3;
+
+    return 4 + (exponent - 2) * 4 + subBucket;
+}
+
+static uint64_t nbsStepsArrivalBucketUpperBound(size_t bucket)
+{
+    if (bucket < 4) {
+        return bucket;
+    }
+
+    size_t exponent = (bucket - 4) / 4 + 2;
+    uint64_t subBucket = (bucket - 4) % 4;
+    uint64_t lowerBound = (4 + subBucket) << (exponent - 2);
+
+    return lowerBound + ((uint64_t) 1 << (exponent - 2)) - 1;
+}
+
+static void nbsStepsAddArrival(NbsStepsArrivalStats* stats, uint64_t interval)
+{
+    if (stats->count == 0 || interval < stats->min) {
+        stats->min = interval;
+    }
+    if (interval > stats->max) {
+        stats->max = interval;
+    }
+    stats->sum += interval;
+    stats->count++;
+    stats->histogram[nbsStepsArrivalBucket(interval)]++;
+}
+
+/// Writes a step to the buffer and records the time it arrived
+/// The time between the writes is added to the arrival statistics.
+/// @param self steps
+/// @param stepId must be the expectedWriteId.
+/// @param time monotonic time, in any unit, must not be earlier than the time of the previous step
+/// @param data application specific step payload
+/// @param stepSize number of octets in data
+/// @return negative on error
+int nbsStepsWriteWithTime(NbsSteps* self, StepId stepId, uint64_t time, const uint8_t* data, size_t stepSize)
+{
+    if (self->hasHeadTime && time < self->headTime) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "step time went backwards for %08X", stepId)
+        return NimbleStepErrTimeWentBackwards;
+    }
+
+    size_t infoIndex = self->infoHeadIndex;
+    int result = nbsStepsWrite(self, stepId, data, stepSize);
+    if (result < 0) {
+        return result;
+    }
+
+    self->times[infoIndex] = time;
+    if (self->hasHeadTime) {
+        nbsStepsAddArrival(&self->arrivalStats, time - self->headTime);
+    }
+    self->headTime = time;
+    self->hasHeadTime = true;
+
+    return result;
+}
+
+/// Writes consecutive steps to the buffer in one go
+/// The whole batch is validated before anything is written, so either all steps are added or none.
+/// @param self steps
+/// @param firstStepId stepId of the first step in the batch, must be the expectedWriteId.
+/// @param packedPayloads the step payloads stored back to back
+/// @param octetCounts octet count for each step in packedPayloads
+/// @param stepCount number of steps in the batch
+/// @return number of steps written or negative on error
+int nbsStepsWriteBatch(NbsSteps* self, StepId firstStepId, const uint8_t* packedPayloads, const size_t* octetCounts,
+                       size_t stepCount)
+{
+    if (stepCount == 0) {
+        return 0;
+    }
+
+    if (self->reservedOctetCount != 0) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "can not write batch while a step is reserved")
+        return NimbleStepErrReservation;
+    }
+
+    if (self->expectedWriteId != firstStepId) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "expected write %08X but got %08X", self->expectedWriteId, firstStepId)
+        nbsStepsStatsWrongStepId(self, firstStepId);
+        return NimbleStepErrWrongStepId;
+    }
+
+    if (self->stepsCount + nbsStepsRetainedCount(self) + stepCount > self->windowSize / 2) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "batch of %zu steps does not fit, %zu out of %zu are used", stepCount,
+                             self->stepsCount, self->windowSize)
+        nbsStepsStatsDropped(self, stepCount);
+        return NimbleStepErrBufferFull;
+    }
+
+    // Prepare the infos in the free part of the window. They are not used until the head is advanced.
+    size_t infoIndex = self->infoHeadIndex;
+    size_t positionInBuffer = self->stepsData.writeIndex;
+    size_t totalOctetCount = 0;
+    for (size_t i = 0; i < stepCount; ++i) {
+        size_t octetCount = octetCounts[i];
+        if (octetCount < NimbleStepMinimumSingleStepOctetCount || octetCount > self->maxStepOctetCount) {
+            NBS_LOG_C_SOFT_ERROR(&self->log, "step %08X in batch has wrong octet count %zu", firstStepId + (StepId) i,
+                                 octetCount)
+            return NimbleStepErrWrongOctetCount;
+        }
+        StepInfo* info = &self->infos[infoIndex];
+        info->octetCount = (uint16_t) octetCount;
+        info->positionInBuffer = (uint32_t) positionInBuffer;
+        self->times[infoIndex] = self->headTime;
+        positionInBuffer = (positionInBuffer + octetCount) % self->stepsData.capacity;
+        totalOctetCount += octetCount;
+        infoIndex = nbsStepsWrapIndex(self, infoIndex + 1);
+    }
+
+    if (nbsStepsWriteAvailable(self) < totalOctetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "no room for batch of %zu octets in buffer", totalOctetCount)
+        nbsStepsStatsDropped(self, stepCount);
+        return NimbleStepErrBufferFull;
+    }
+
+    int errorCode = discoidBufferWrite(&self->stepsData, packedPayloads, totalOctetCount);
+    if (errorCode < 0) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "couldn't write batch of %zu octets to buffer %d", totalOctetCount, errorCode)
+        return errorCode;
+    }
+
+    if (self->isRangeHashEnabled) {
+        const uint8_t* payload = packedPayloads;
+        size_t hashInfoIndex = self->infoHeadIndex;
+        for (size_t i = 0; i < stepCount; ++i) {
+            nbsStepsUpdateRangeHash(self, hashInfoIndex, firstStepId + (StepId) i, payload, octetCounts[i]);
+            payload += octetCounts[i];
+            hashInfoIndex = nbsStepsWrapIndex(self, hashInfoIndex + 1);
+        }
+    }
+
+    self->infoHeadIndex = infoIndex;
+    self->expectedWriteId += (StepId) stepCount;
+    self->stepsCount += stepCount;
+
+    if (self->stats) {
+        for (size_t i = 0; i < stepCount; ++i) {
+            nbsStepsStatsWritten(self, octetCounts[i]);
+        }
+    }
+
+    if (self->writeListener) {
+        const uint8_t* payload = packedPayloads;
+        for (size_t i = 0; i < stepCount; ++i) {
+            self->writeListener(self->writeListenerUserData, firstStepId + (StepId) i, payload, octetCounts[i]);
+            payload += octetCounts[i];
+        }
+    }
+
+    return (int) stepCount;
+}
+
+static void nbsStepsAdvanceWrite(NbsSteps* self, size_t octetCount)
+{
+    DiscoidBuffer* buffer = &self->stepsData;
+    buffer->writeIndex = (buffer->writeIndex + octetCount) % buffer->capacity;
+    buffer->size += octetCount;
+}
+
+/// Reserves contiguous space for the next step directly in the buffer
+/// The reserved space never wraps around the end of the buffer, the octets left at the end are skipped instead.
+/// Nothing is visible to readers until nbsStepsWriteCommit is called.
+/// @param self steps
+/// @param stepId must be the expectedWriteId.
+/// @param maxOctetCount maximum number of octets that will be written for the step, at most the maximum step octet
+/// count set at init
+/// @param outPayload set to where the step payload should be written
+/// @return negative on error
+int nbsStepsWriteReserve(NbsSteps* self, StepId stepId, size_t maxOctetCount, uint8_t** outPayload)
+{
+    if (self->reservedOctetCount != 0) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "a step is already reserved")
+        return NimbleStepErrReservation;
+    }
+
+    if (maxOctetCount < NimbleStepMinimumSingleStepOctetCount || maxOctetCount > self->maxStepOctetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "can not reserve %zu octets for a step", maxOctetCount)
+        return NimbleStepErrWrongOctetCount;
+    }
+
+    if (self->expectedWriteId != stepId) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "expected write %08X but got %08X", self->expectedWriteId, stepId)
+        nbsStepsStatsWrongStepId(self, stepId);
+        return NimbleStepErrWrongStepId;
+    }
+
+    if (self->stepsCount + nbsStepsRetainedCount(self) == self->windowSize / 2) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "buffer is full. %zu out of %zu", self->stepsCount, self->windowSize)
+        nbsStepsStatsDropped(self, 1);
+        return NimbleStepErrBufferFull;
+    }
+
+    DiscoidBuffer* buffer = &self->stepsData;
+    size_t octetCountUntilEnd = buffer->capacity - buffer->writeIndex;
+    size_t paddingOctetCount = octetCountUntilEnd < maxOctetCount ? octetCountUntilEnd : 0;
+
+    if (nbsStepsWriteAvailable(self) < paddingOctetCount + maxOctetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "no room to reserve %zu octets in buffer", maxOctetCount)
+        nbsStepsStatsDropped(self, 1);
+        return NimbleStepErrBufferFull;
+    }
+
+    if (paddingOctetCount > 0) {
+        nbsStepsAdvanceWrite(self, paddingOctetCount);
+    }
+
+    self->reservedOctetCount = maxOctetCount;
+    *outPayload = buffer->buffer + buffer->writeIndex;
+
+    return 0;
+}
+
+/// Adds the reserved step to the buffer
+/// @param self steps
+/// @param octetCount number of octets actually written, must not be more than reserved
+/// @return octetCount or negative on error
+int nbsStepsWriteCommit(NbsSteps* self, size_t octetCount)
+{
+    if (self->reservedOctetCount == 0) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "no step is reserved")
+        return NimbleStepErrReservation;
+    }
+
+    if (octetCount < NimbleStepMinimumSingleStepOctetCount || octetCount > self->reservedOctetCount) {
+        NBS_LOG_C_SOFT_ERROR(&self->log, "wrote %zu octets, but reserved %zu", octetCount, self->reservedOctetCount)
+        return NimbleStepErrWrongOctetCount;
+    }
+
+    StepInfo* info = &self->infos[self->infoHeadIndex];
+    info->octetCount = (uint16_t) octetCount;
+    info->positionInBuffer = (uint32_t) self->stepsData.writeIndex;
+    self->times[self->infoHeadIndex] = self->headTime;
+
+    if (self->isRangeHashEnabled) {
+        nbsStepsUpdateRangeHash(self, self->infoHeadIndex, self->expectedWriteId,
+                                self->stepsData.buffer + info->positionInBuffer, octetCount);
+    }
+
+    nbsStepsAdvanceWrite(self, octetCount);
+
+    self->infoHeadIndex = nbsStepsWrapIndex(self, self->infoHeadIndex + 1);
+    self->expectedWriteId++;
+    self->stepsCount++;
+    self->reservedOctetCount = 0;
+
+    nbsStepsStatsWritten(self, octetCount);
+
+    if (self->writeListener) {
+        // Reserved steps are never split, so the payload is contiguous
+        self->writeListener(self->writeListenerUserData, self->expectedWriteId - 1,
+                            self->stepsData.buffer + info->positionInBuffer, octetCount);
+    }
+
+    return (int) octetCount;
+}
+
+/// Cancels a reservation. Any octets skipped at the end of the buffer stay skipped.
+/// @param self steps
+void nbsStepsWriteCancel(NbsSteps* self)
+{
+    self->reservedOctetCount = 0;
+}
+
+/// Turns the range hash on or off. When turned on, the hashes for the steps already in the buffer are calculated.
+/// @param self steps
+/// @param isEnabled true to keep a rolling hash of the steps
+void nbsStepsSetRangeHashEnabled(NbsSteps* self, bool isEnabled)
+{
+    if (!isEnabled || self->isRangeHashEnabled) {
+        self->isRangeHashEnabled = isEnabled;
+        return;
+    }
+
+    self->tailPrefixHash = 0;
+    self->headPrefixHash = 0;
+
+    uint8_t joined[1024];
+    for (size_t i = 0; i < self->stepsCount; ++i) {
+        size_t infoIndex = nbsStepsWrapIndex(self, self->infoTailIndex + i);
+        NbsStepView view;
+        nbsStepsFillView(self, &self->infos[infoIndex], self->expectedReadId + (StepId) i, &view);
+        const uint8_t* payload = view.first.payload;
+        if (view.second.octetCount > 0) {
+            tc_memcpy_octets(joined, view.first.payload, view.first.octetCount);
+            tc_memcpy_octets(joined + view.first.octetCount, view.second.payload, view.second.octetCount);
+            payload = joined;
+        }
+        nbsStepsUpdateRangeHash(self, infoIndex, view.stepId, payload, view.first.octetCount + view.second.octetCount);
+    }
+
+    self->isRangeHashEnabled = true;
+}
+
+/// Calculates a hash of a range of steps in O(1), from a rolling sum of the step hashes kept on write
+/// Two buffers with the same steps in the range have the same range hash, regardless of what else they contain.
+/// @param self steps
+/// @param fromStepId first step in the range
+/// @param toStepId last step in the range, inclusive
+/// @param hash set to the range hash
+/// @return negative if the range hash is not enabled or the range is not in the buffer
+int nbsStepsRangeHash(const NbsSteps* self, StepId fromStepId, StepId toStepId, uint64_t* hash)
+{
+    if (!self->isRangeHashEnabled) {
+        return NimbleStepErrRangeHashDisabled;
+    }
+
+    int toIndex = nbsStepsGetIndexForStep(self, toStepId);
+    if (toIndex < 0 || fromStepId > toStepId || fromStepId < self->expectedReadId) {
+        return NimbleStepErrStepNotFound;
+    }
+
+    uint64_t beforeRange = fromStepId == self->expectedReadId
+                               ? self->tailPrefixHash
+                               : self->prefixHashes[nbsStepsGetIndexForStep(self, fromStepId - 1)];
+
+    *hash = self->prefixHashes[toIndex] - beforeRange;
+
+    return 0;
+}
+
+/// Gets the time recorded for a step
+/// Steps written without a time get the time of the step before them.
+/// @param self steps
+/// @param stepId the step
+/// @param time set to the time of the step
+/// @return negative if the step is not in the buffer
+int nbsStepsTimeForStep(const NbsSteps* self, StepId stepId, uint64_t* time)
+{
+    int infoIndex = nbsStepsGetIndexForStep(self, stepId);
+    if (infoIndex < 0) {
+        return infoIndex;
+    }
+
+    *time = self->times[infoIndex];
+
+    return 0;
+}
+
+/// Finds the first step that was written at or after a time, with a binary search
+/// @param self steps
+/// @param time the time to look for
+/// @param stepId set to the first step at or after the time
+/// @return negative if no step was written at or after the time
+int nbsStepsFindFirstAtOrAfterTime(const NbsSteps* self, uint64_t time, StepId* stepId)
+{
+    // The times are monotonic from the tail to the head, so search on the distance from the tail
+    size_t low = 0;
+    size_t high = self->stepsCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (self->times[nbsStepsWrapIndex(self, self->infoTailIndex + middle)] < time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low == self->stepsCount) {
+        return NimbleStepErrStepNotFound;
+    }
+
+    *stepId = self->expectedReadId + (StepId) low;
+
+    return 0;
+}
+
+/// Summarizes the inter-arrival times of the steps written with nbsStepsWriteWithTime
+/// @param self steps
+/// @param summary the summary to fill out
+void nbsStepsArrivalSummary(const NbsSteps* self, NbsStepsArrivalSummary* summary)
+{
+    const NbsStepsArrivalStats* stats = &self->arrivalStats;
+
+    summary->count = stats->count;
+    summary->min = stats->min;
+    summary->max = stats->max;
+    summary->average = stats->count > 0 ? stats->sum / stats->count : 0;
+    summary->percentile99 = 0;
+
+    size_t countAtPercentile = stats->count - stats->count / 100;
+    size_t accumulatedCount = 0;
+    for (size_t i = 0; i < NBS_STEPS_ARRIVAL_HISTOGRAM_BUCKET_COUNT && stats->count > 0; ++i) {
+        accumulatedCount += stats->histogram[i];
+        if (accumulatedCount >= countAtPercentile) {
+            uint64_t upperBound = nbsStepsArrivalBucketUpperBound(i);
+            summary->percentile99 = upperBound < stats->max ? upperBound : stats->max;
+            break;
+        }
+    }
+}
+
+/// Clears the arrival statistics
+/// @param self steps
+void nbsStepsResetArrivalStats(NbsSteps* self)
+{
+    tc_mem_clear_type(&self->arrivalStats);
+}
+
+/// Sets a listener that is called for every step added to the buffer, e.g. nbsStepLogWriteListener
+/// @param self steps
+/// @param listener function to call, or NULL to remove the listener
+/// @param userData passed to the listener
+void nbsStepsSetWriteListener(NbsSteps* self, NbsStepsWriteListenerFn listener, void* userData)
+{
+    self->writeListener = listener;
+    self->writeListenerUserData = userData;
+}
+
+/// Enables the hot path counters. The stats are cleared and updated by the thread that owns the steps.
+/// @param self steps
+/// @param stats stats to update, must outlive the steps, or NULL to disable the counting
+void nbsStepsSetStats(NbsSteps* self, NbsStepsStats* stats)
+{
+    if (stats) {
+        tc_mem_clear_type(stats);
+    }
+    self->stats = stats;
+}
+
+/// Adds the current number of stored steps to the depth histogram, call it once each tick
+/// nbsStepsBufferingUpdate calls it, so it is only needed when buffering is not used.
+/// @param self steps
+void nbsStepsStatsSampleDepth(NbsSteps* self)
+{
+    if (!self->stats) {
+        return;
+    }
+
+    size_t bucket = self->stepsCount < NBS_STEPS_STATS_DEPTH_BUCKET_COUNT ? self->stepsCount
+                                                                          : NBS_STEPS_STATS_DEPTH_BUCKET_COUNT - 1;
+    nbsStepsStatsAdd(&self->stats->depthHistogram[bucket], 1);
+}
+
+/// Copies the stats without locks, for example from a monitoring thread
+/// Each counter is read atomically, but the counters can be from slightly different points in time.
+/// @param stats stats updated by the thread that owns the steps
+/// @param target the copy to fill out
+void nbsStepsStatsRead(const NbsStepsStats* stats, NbsStepsStats* target)
+{
+    target->writeCount = nbsAtomicLoadAcquire(&stats->writeCount);
+    target->readCount = nbsAtomicLoadAcquire(&stats->readCount);
+    target->discardCount = nbsAtomicLoadAcquire(&stats->discardCount);
+    target->droppedCount = nbsAtomicLoadAcquire(&stats->droppedCount);
+    target->lateCount = nbsAtomicLoadAcquire(&stats->lateCount);
+    target->outOfOrderCount = nbsAtomicLoadAcquire(&stats->outOfOrderCount);
+    target->peakStepCount = nbsAtomicLoadAcquire(&stats->peakStepCount);
+    for (size_t i = 0; i < NBS_STEPS_STATS_DEPTH_BUCKET_COUNT; ++i) {
+        target->depthHistogram[i] = nbsAtomicLoadAcquire(&stats->depthHistogram[i]);
+    }
+    for (size_t i = 0; i < NBS_STEPS_STATS_OCTET_BUCKET_COUNT; ++i) {
+        target->octetCountHistogram[i] = nbsAtomicLoadAcquire(&stats->octetCountHistogram[i]);
+    }
+}
+
+/// Reserves contiguous space for the next step and sets up an out stream that serializes directly into it
+/// @param self steps
+/// @param stepId must be the expectedWriteId.
+/// @param maxOctetCount maximum number of octets that will be written for the step
+/// @param stream out stream to initialize
+/// @return negative on error
+int nbsStepsWriteReserveStream(NbsSteps* self, StepId stepId, size_t maxOctetCount, struct FldOutStream* stream)
+{
+    uint8_t* payload;
+    int errorCode = nbsStepsWriteReserve(self, stepId, maxOctetCount, &payload);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    fldOutStreamInit(stream, payload, maxOctetCount);
+
+    return 0;
+}
+
+/// Adds the reserved step to the buffer, with the octets written to the stream as payload
+/// @param self steps
+/// @param stream the stream initialized by nbsStepsWriteReserveStream
+/// @return octet count or negative on error
+int nbsStepsWriteCommitStream(NbsSteps* self, const struct FldOutStream* stream)
+{
+    return nbsStepsWriteCommit(self, stream->pos);
+}
+
 /// Checks the tickId of the next step available for reading from the buffer, but does not read it.
 /// @param self steps
 /// @param stepId id of step to look at
@@ -390,6 +1430,14 @@ bool nbsStepsLatestStepId(const NbsSteps* self, StepId* id)
     return true;
 }
 
+/// Returns the number of steps stored in the buffer
+/// @param self steps
+/// @return number of steps available for reading
+size_t nbsStepsCount(const NbsSteps* self)
+{
+    return self->stepsCount;
+}
+
 /// The number of tickIds that are ahead of what is supposed to be written to the buffer
 /// @param self steps
 /// @param firstReadStepId the stepId to compare with
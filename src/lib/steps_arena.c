@@ -0,0 +1,162 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved.
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+#include <clog/clog.h>
+#include <imprint/allocator.h>
+#include <imprint/linear_allocator.h>
+#include <nimble-steps/steps_arena.h>
+
+#define NBS_STEPS_ARENA_SLOT_ALIGNMENT (64)
+#define NBS_STEPS_ARENA_NO_FREE_SLOT ((size_t) -1)
+
+static size_t nbsStepsArenaAlignUp(size_t octetCount, size_t alignment)
+{
+    return (octetCount + alignment - 1) / alignment * alignment;
+}
+
+/// Calculates the octets each steps buffer uses in the slab. This is the memory footprint for one session buffer.
+/// @param maxOctetSizeForCombinedStep maximum number of octets for each combined step
+/// @param windowSize number of step infos in the window
+/// @return octet count for one slot, a multiple of the cache line size
+size_t nbsStepsArenaSlotOctetCount(size_t maxOctetSizeForCombinedStep, size_t windowSize)
+{
+    // Room to align each of the four allocations done by nbsStepsInit
+    size_t alignmentSlack = 4 * NBS_STEPS_ARENA_SLOT_ALIGNMENT;
+
+    return nbsStepsArenaAlignUp(nbsStepsFootprint(maxOctetSizeForCombinedStep, windowSize) + alignmentSlack,
+                                NBS_STEPS_ARENA_SLOT_ALIGNMENT);
+}
+
+/// Calculates the slab size needed for a number of steps buffers, rounded up to a whole number of huge pages
+/// @param slotCount number of steps buffers
+/// @param maxOctetSizeForCombinedStep maximum number of octets for each combined step
+/// @param windowSize number of step infos in the window
+/// @return octet count for the slab
+size_t nbsStepsArenaSlabOctetCount(size_t slotCount, size_t maxOctetSizeForCombinedStep, size_t windowSize)
+{
+    return nbsStepsArenaAlignUp(slotCount * nbsStepsArenaSlotOctetCount(maxOctetSizeForCombinedStep, windowSize),
+                                NBS_STEPS_ARENA_HUGE_PAGE_SIZE);
+}
+
+/// Initializes an arena over a slab of memory
+/// The slab is typically a huge page mapping, sized with nbsStepsArenaSlabOctetCount. It must outlive the arena.
+/// @param self arena
+/// @param allocator allocator for the slot table
+/// @param slab memory to carve the steps buffers from
+/// @param slabOctetCount octet count of slab
+/// @param maxOctetSizeForCombinedStep maximum number of octets for each combined step
+/// @param windowSize number of step infos in the window for each steps buffer
+/// @param log the log to use
+/// @return negative on error
+int nbsStepsArenaInit(NbsStepsArena* self, struct ImprintAllocator* allocator, uint8_t* slab, size_t slabOctetCount,
+                      size_t maxOctetSizeForCombinedStep, size_t windowSize, Clog log)
+{
+    tc_mem_clear_type(self);
+    self->log = log;
+    self->slotOctetCount = nbsStepsArenaSlotOctetCount(maxOctetSizeForCombinedStep, windowSize);
+    self->slotCount = slabOctetCount / self->slotOctetCount;
+    if (self->slotCount == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "slab of %zu octets can not hold a steps buffer of %zu octets", slabOctetCount,
+                          self->slotOctetCount)
+        return NimbleStepErrTargetTooSmall;
+    }
+
+    self->slab = slab;
+    self->slots = IMPRINT_ALLOC_TYPE_COUNT(allocator, NbsStepsArenaSlot, self->slotCount);
+
+    for (size_t i = 0; i < self->slotCount; ++i) {
+        NbsStepsArenaSlot* slot = &self->slots[i];
+        ImprintLinearAllocator slotAllocator;
+        imprintLinearAllocatorInit(&slotAllocator, slab + i * self->slotOctetCount, self->slotOctetCount,
+                                   "stepsArenaSlot");
+        nbsStepsInitWithWindowSize(&slot->steps, &slotAllocator.info, maxOctetSizeForCombinedStep, windowSize, log);
+        nbsStepsReset(&slot->steps);
+        slot->isInUse = false;
+        slot->nextFreeIndex = i + 1 < self->slotCount ? i + 1 : NBS_STEPS_ARENA_NO_FREE_SLOT;
+    }
+
+    self->firstFreeIndex = 0;
+    self->acquiredCount = 0;
+
+    return 0;
+}
+
+/// Takes a free steps buffer from the arena
+/// @param self arena
+/// @param initialId the first StepId that is expected to be written to the steps buffer
+/// @param outSteps set to the steps buffer
+/// @return negative on error
+int nbsStepsArenaAcquire(NbsStepsArena* self, StepId initialId, NbsSteps** outSteps)
+{
+    if (self->firstFreeIndex == NBS_STEPS_ARENA_NO_FREE_SLOT) {
+        CLOG_C_SOFT_ERROR(&self->log, "all %zu steps buffers in the arena are in use", self->slotCount)
+        return NimbleStepErrNoFreeSlot;
+    }
+
+    NbsStepsArenaSlot* slot = &self->slots[self->firstFreeIndex];
+    self->firstFreeIndex = slot->nextFreeIndex;
+    self->acquiredCount++;
+
+    slot->isInUse = true;
+    nbsStepsReInit(&slot->steps, initialId);
+    *outSteps = &slot->steps;
+
+    return 0;
+}
+
+/// Clears everything the previous owner set up, so the next owner gets the steps buffer as if it was just initialized
+static void nbsStepsArenaClearSession(NbsSteps* steps)
+{
+    nbsStepsReset(steps);
+    nbsStepsSetWriteListener(steps, 0, 0);
+    nbsStepsSetStats(steps, 0);
+    nbsStepsSetRangeHashEnabled(steps, false);
+    nbsStepsSetTargetDepth(steps, steps->windowSize / 4);
+    nbsStepsReleaseRetained(steps);
+    for (int i = 0; i < NBS_STEPS_MAX_CURSOR_COUNT; ++i) {
+        nbsStepsCursorRemove(steps, i);
+    }
+}
+
+/// Resets the steps buffer, including the listener, stats, cursors and options, and returns it to the arena
+/// @param self arena
+/// @param steps a steps buffer acquired from this arena
+/// @return negative on error
+int nbsStepsArenaRelease(NbsStepsArena* self, NbsSteps* steps)
+{
+    NbsStepsArenaSlot* slot = (NbsStepsArenaSlot*) steps;
+    if (slot < self->slots || slot >= self->slots + self->slotCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "steps buffer is not from this arena")
+        return NimbleStepErrIndexOutOfRange;
+    }
+
+    if (!slot->isInUse) {
+        CLOG_C_SOFT_ERROR(&self->log, "steps buffer is already released")
+        return NimbleStepErrNotInUse;
+    }
+
+    nbsStepsArenaClearSession(steps);
+    slot->isInUse = false;
+    slot->nextFreeIndex = self->firstFreeIndex;
+    self->firstFreeIndex = (size_t) (slot - self->slots);
+    self->acquiredCount--;
+
+    return 0;
+}
+
+/// Returns the number of steps buffers that are in use
+/// @param self arena
+/// @return number of acquired steps buffers
+size_t nbsStepsArenaAcquiredCount(const NbsStepsArena* self)
+{
+    return self->acquiredCount;
+}
+
+/// Returns the number of steps buffers that can be acquired
+/// @param self arena
+/// @return number of free steps buffers
+size_t nbsStepsArenaFreeCount(const NbsStepsArena* self)
+{
+    return self->slotCount - self->acquiredCount;
+}
@@ -3,8 +3,24 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------*/
 #include "utest.h"
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
 #include <imprint/linear_allocator.h>
+#include <nimble-steps/buffering.h>
+#include <nimble-steps/combined_step.h>
+#include <nimble-steps/fan_out.h>
 #include <nimble-steps/pending_steps.h>
+#include <nimble-steps/redundant_steps.h>
+#include <nimble-steps/spsc_steps.h>
+#include <nimble-steps/step_codec.h>
+#include <nimble-steps/step_log.h>
+#include <nimble-steps/steps.h>
+#include <nimble-steps/steps_arena.h>
+
+#if !defined _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 UTEST(NimbleSteps, verifyReceiveMask)
 {
@@ -125,3 +141,1582 @@ UTEST(NimbleSteps, receivedTooFarInThePast)
     int error2 = nimbleStepsReceiveMaskReceivedStep(&receiveMask, receivedId2);
     ASSERT_LT(error2, 0);
 }
+
+static void testStepsInit(NbsSteps* steps, ImprintLinearAllocator* allocator, uint8_t* memory, size_t memorySize,
+                          StepId initialId, const char* prefix)
+{
+    Clog log;
+
+    log.config = &g_clog;
+    log.constantPrefix = prefix;
+
+    imprintLinearAllocatorInit(allocator, memory, memorySize, prefix);
+    nbsStepsInit(steps, &allocator->info, 64, log);
+    nbsStepsReInit(steps, initialId);
+}
+
+static uint8_t testStepsMemory[64 * 1024];
+
+UTEST(NimbleSteps, getIndexForStepAfterWrapAround)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 1000;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "getIndexForStep");
+
+    uint8_t payload[4] = {0x10, 0x20, 0x30, 0x40};
+    StepId writeId = startId;
+
+    for (size_t i = 0; i < NBS_WINDOW_SIZE + 10; ++i) {
+        payload[0] = (uint8_t) writeId;
+        ASSERT_EQ(4, nbsStepsWrite(&steps, writeId, payload, 4));
+        writeId++;
+        if (nbsStepsCount(&steps) > 20) {
+            ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 1));
+        }
+    }
+
+    StepId firstId;
+    ASSERT_TRUE(nbsStepsPeek(&steps, &firstId));
+    ASSERT_LT(steps.infoHeadIndex, steps.infoTailIndex);
+
+    for (StepId id = firstId; id < writeId; ++id) {
+        int index = nbsStepsGetIndexForStep(&steps, id);
+        ASSERT_GE(index, 0);
+        uint8_t readPayload[4];
+        ASSERT_EQ(4, nbsStepsReadAtIndex(&steps, index, readPayload, sizeof(readPayload)));
+        ASSERT_EQ((uint8_t) id, readPayload[0]);
+    }
+
+    ASSERT_EQ(NimbleStepErrStepNotFound, nbsStepsGetIndexForStep(&steps, firstId - 1));
+    ASSERT_EQ(NimbleStepErrStepNotFound, nbsStepsGetIndexForStep(&steps, writeId));
+}
+
+UTEST(NimbleSteps, viewSplitsWrappedStep)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 20;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "viewSplitsWrappedStep");
+
+    uint8_t payload[50];
+    StepId writeId = startId;
+    bool foundWrappedStep = false;
+
+    for (size_t i = 0; i < 400; ++i) {
+        for (size_t j = 0; j < sizeof(payload); ++j) {
+            payload[j] = (uint8_t) (writeId + j);
+        }
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+
+        NbsStepView view;
+        int indexForStep = nbsStepsGetIndexForStep(&steps, writeId);
+        ASSERT_EQ((int) sizeof(payload), nbsStepsViewAtIndex(&steps, indexForStep, &view));
+        ASSERT_EQ(writeId, view.stepId);
+        ASSERT_EQ(sizeof(payload), view.first.octetCount + view.second.octetCount);
+        ASSERT_EQ(0, memcmp(view.first.payload, payload, view.first.octetCount));
+        if (view.second.octetCount > 0) {
+            foundWrappedStep = true;
+            ASSERT_EQ(0, memcmp(view.second.payload, payload + view.first.octetCount, view.second.octetCount));
+        }
+        writeId++;
+
+        if (nbsStepsCount(&steps) > 10) {
+            NbsStepView tailView;
+            StepId peekedId;
+            ASSERT_TRUE(nbsStepsPeek(&steps, &peekedId));
+            ASSERT_EQ((int) sizeof(payload), nbsStepsPeekView(&steps, &tailView));
+            ASSERT_EQ(peekedId, tailView.stepId);
+            ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 1));
+        }
+    }
+
+    ASSERT_TRUE(foundWrappedStep);
+
+    NbsStepView exactView;
+    StepId wantedId = writeId - 3;
+    ASSERT_EQ((int) sizeof(payload), nbsStepsViewExactStepId(&steps, wantedId, &exactView));
+    ASSERT_EQ(wantedId, exactView.stepId);
+    ASSERT_EQ(3, nbsStepsCount(&steps));
+}
+
+UTEST(NimbleSteps, writeBatch)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 300;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "writeBatch");
+
+    uint8_t packed[64];
+    size_t octetCounts[4] = {3, 10, 1, 20};
+    for (size_t i = 0; i < sizeof(packed); ++i) {
+        packed[i] = (uint8_t) i;
+    }
+
+    ASSERT_LT(nbsStepsWriteBatch(&steps, startId + 1, packed, octetCounts, 4), 0);
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+
+    ASSERT_EQ(4, nbsStepsWriteBatch(&steps, startId, packed, octetCounts, 4));
+    ASSERT_EQ(4, nbsStepsCount(&steps));
+
+    size_t offset = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        StepId readId;
+        uint8_t target[64];
+        ASSERT_EQ((int) octetCounts[i], nbsStepsRead(&steps, &readId, target, sizeof(target)));
+        ASSERT_EQ(startId + (StepId) i, readId);
+        ASSERT_EQ(0, memcmp(target, packed + offset, octetCounts[i]));
+        offset += octetCounts[i];
+    }
+
+    uint8_t single = 0x42;
+    ASSERT_EQ(1, nbsStepsWrite(&steps, startId + 4, &single, 1));
+}
+
+UTEST(NimbleSteps, discardManyAtOnce)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 8;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "discardManyAtOnce");
+
+    uint8_t payload[60];
+    StepId writeId = startId;
+    for (size_t round = 0; round < 6; ++round) {
+        for (size_t i = 0; i < 100; ++i) {
+            size_t octetCount = 1 + (writeId % sizeof(payload));
+            payload[0] = (uint8_t) writeId;
+            ASSERT_EQ((int) octetCount, nbsStepsWrite(&steps, writeId, payload, octetCount));
+            writeId++;
+        }
+
+        StepId firstId;
+        ASSERT_TRUE(nbsStepsPeek(&steps, &firstId));
+        ASSERT_EQ(90, nbsStepsDiscardUpTo(&steps, firstId + 90));
+        ASSERT_EQ(10, nbsStepsCount(&steps));
+
+        StepId readId;
+        uint8_t target[64];
+        int octetCount = nbsStepsRead(&steps, &readId, target, sizeof(target));
+        ASSERT_EQ(firstId + 90, readId);
+        ASSERT_EQ((int) (1 + (readId % sizeof(payload))), octetCount);
+        ASSERT_EQ((uint8_t) readId, target[0]);
+
+        ASSERT_EQ(0, nbsStepsDiscardCount(&steps, nbsStepsCount(&steps)));
+        ASSERT_EQ(0, nbsStepsCount(&steps));
+        ASSERT_EQ(0, steps.stepsData.size);
+    }
+}
+
+UTEST(NimbleSteps, rejectsInvalidWritesAndReads)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 77;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "rejectsInvalid");
+
+    uint8_t payload[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    StepId discardedId;
+    ASSERT_EQ(NimbleStepErrCollectionIsEmpty, nbsStepsDiscard(&steps, &discardedId));
+    ASSERT_EQ(NimbleStepErrCollectionIsEmpty, nbsStepsGetIndexForStep(&steps, startId));
+
+    ASSERT_EQ(NimbleStepErrWrongStepId, nbsStepsWrite(&steps, startId + 1, payload, sizeof(payload)));
+    ASSERT_EQ(NimbleStepErrMalformedStep, nbsStepsWrite(&steps, startId, payload, 0));
+
+    // Steps larger than the maximum set at init are rejected by all the write functions
+    uint8_t largePayload[65];
+    tc_memset_octets(largePayload, 0x5a, sizeof(largePayload));
+    size_t largeOctetCount = sizeof(largePayload);
+    uint8_t* reserved;
+    ASSERT_EQ(NimbleStepErrWrongOctetCount, nbsStepsWrite(&steps, startId, largePayload, sizeof(largePayload)));
+    ASSERT_EQ(NimbleStepErrWrongOctetCount, nbsStepsWriteBatch(&steps, startId, largePayload, &largeOctetCount, 1));
+    ASSERT_EQ(NimbleStepErrWrongOctetCount, nbsStepsWriteReserve(&steps, startId, sizeof(largePayload), &reserved));
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+
+    // Delta steps are checked by their encoded size, which may fit even if the worst case encoding does not
+    NbsStepCodec encoder;
+    NbsStepCodec decoder;
+    nbsStepCodecInit(&encoder);
+    nbsStepCodecInit(&decoder);
+    ASSERT_EQ(NimbleStepErrWrongOctetCount, nbsStepsWriteDelta(&steps, &encoder, startId, largePayload, 64));
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+    ASSERT_GT(nbsStepsWriteDelta(&steps, &encoder, startId, largePayload, 60), 0);
+    ASSERT_GT(nbsStepsWriteDelta(&steps, &encoder, startId + 1, largePayload, 60), 0);
+    uint8_t decoded[60];
+    StepId decodedId;
+    for (size_t i = 0; i < 2; ++i) {
+        tc_memset_octets(decoded, 0, sizeof(decoded));
+        ASSERT_EQ(60, nbsStepsReadDelta(&steps, &decoder, &decodedId, decoded, sizeof(decoded)));
+        ASSERT_EQ(startId + (StepId) i, decodedId);
+        ASSERT_EQ(0, memcmp(largePayload, decoded, sizeof(decoded)));
+    }
+    startId += 2;
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+
+    StepId writeId = startId;
+    while (nbsStepsCount(&steps) < NBS_WINDOW_SIZE / 2) {
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+        writeId++;
+    }
+    ASSERT_EQ(NimbleStepErrBufferFull, nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+
+    StepId readId;
+    uint8_t smallTarget[4];
+    ASSERT_EQ(NimbleStepErrTargetTooSmall, nbsStepsRead(&steps, &readId, smallTarget, sizeof(smallTarget)));
+    ASSERT_EQ(NBS_WINDOW_SIZE / 2, nbsStepsCount(&steps));
+    ASSERT_EQ(NimbleStepErrIndexOutOfRange, nbsStepsReadAtIndex(&steps, NBS_WINDOW_SIZE, smallTarget, 4));
+
+    ASSERT_EQ(NimbleStepErrTooManyToDiscard, nbsStepsDiscardCount(&steps, NBS_WINDOW_SIZE / 2 + 1));
+    ASSERT_EQ(NBS_WINDOW_SIZE / 2, nbsStepsCount(&steps));
+
+    uint8_t target[8];
+    ASSERT_EQ((int) sizeof(payload), nbsStepsRead(&steps, &readId, target, sizeof(target)));
+    ASSERT_EQ(startId, readId);
+}
+
+UTEST(NimbleSteps, configurableWindowSize)
+{
+    static const size_t windowSizes[] = {8, 12, 1024};
+
+    for (size_t w = 0; w < sizeof(windowSizes) / sizeof(windowSizes[0]); ++w) {
+        size_t windowSize = windowSizes[w];
+        NbsSteps steps;
+        ImprintLinearAllocator allocator;
+        Clog log;
+
+        log.config = &g_clog;
+        log.constantPrefix = "configurableWindowSize";
+
+        imprintLinearAllocatorInit(&allocator, testStepsMemory, sizeof(testStepsMemory), "configurableWindowSize");
+        nbsStepsInitWithWindowSize(&steps, &allocator.info, 16, windowSize, log);
+        StepId startId = 77;
+        nbsStepsReInit(&steps, startId);
+
+        ASSERT_EQ(windowSize, steps.windowSize);
+
+        uint8_t payload[16];
+        StepId writeId = startId;
+        size_t maxStoredCount = windowSize / 2;
+        for (size_t i = 0; i < windowSize * 3; ++i) {
+            payload[0] = (uint8_t) writeId;
+            ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+            writeId++;
+            if (nbsStepsCount(&steps) == maxStoredCount - 1) {
+                ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 1));
+            }
+        }
+
+        for (StepId id = writeId - (StepId) (maxStoredCount - 2); id < writeId; ++id) {
+            int index = nbsStepsGetIndexForStep(&steps, id);
+            ASSERT_GE(index, 0);
+            ASSERT_LT((size_t) index, windowSize);
+            uint8_t target[16];
+            ASSERT_EQ((int) sizeof(target), nbsStepsReadAtIndex(&steps, index, target, sizeof(target)));
+            ASSERT_EQ((uint8_t) id, target[0]);
+        }
+    }
+}
+
+UTEST(NimbleSteps, spscWriteAndRead)
+{
+    NbsSpscSteps steps;
+    ImprintLinearAllocator allocator;
+    Clog log;
+
+    log.config = &g_clog;
+    log.constantPrefix = "spscWriteAndRead";
+
+    imprintLinearAllocatorInit(&allocator, testStepsMemory, sizeof(testStepsMemory), "spscWriteAndRead");
+    ASSERT_EQ(NimbleStepErrWindowSize, nbsSpscStepsInit(&steps, &allocator.info, 32, 12, log));
+    ASSERT_EQ(0, nbsSpscStepsInit(&steps, &allocator.info, 32, 16, log));
+
+    // The producer and consumer fields must not share a cache line
+    ASSERT_EQ(0, offsetof(NbsSpscSteps, readCount) % NBS_SPSC_CACHE_LINE_SIZE);
+    ASSERT_GE(offsetof(NbsSpscSteps, readCount), offsetof(NbsSpscSteps, writeOctetIndex) + sizeof(size_t));
+    ASSERT_GE(offsetof(NbsSpscSteps, payload), offsetof(NbsSpscSteps, expectedReadId) + sizeof(StepId));
+    ASSERT_EQ(0, (uintptr_t) &steps % NBS_SPSC_CACHE_LINE_SIZE);
+
+    StepId startId = 4000;
+    nbsSpscStepsReInit(&steps, startId);
+
+    uint8_t payload[32];
+    StepId writeId = startId;
+    StepId readId = startId;
+
+    for (size_t round = 0; round < 50; ++round) {
+        while (1) {
+            size_t octetCount = 1 + (writeId % sizeof(payload));
+            payload[octetCount - 1] = (uint8_t) (writeId + 1);
+            payload[0] = (uint8_t) writeId;
+            int result = nbsSpscStepsWrite(&steps, writeId, payload, octetCount);
+            if (result < 0) {
+                break;
+            }
+            writeId++;
+        }
+        ASSERT_EQ(8, nbsSpscStepsCount(&steps));
+
+        NbsStepView view;
+        ASSERT_EQ((int) (1 + (readId % sizeof(payload))), nbsSpscStepsPeekView(&steps, &view));
+        ASSERT_EQ(readId, view.stepId);
+
+        for (size_t i = 0; i < 5; ++i) {
+            uint8_t target[32];
+            StepId stepId;
+            int octetCount = nbsSpscStepsRead(&steps, &stepId, target, sizeof(target));
+            ASSERT_EQ((int) (1 + (readId % sizeof(payload))), octetCount);
+            ASSERT_EQ(readId, stepId);
+            ASSERT_EQ((uint8_t) readId, target[0]);
+            if (octetCount > 1) {
+                ASSERT_EQ((uint8_t) (readId + 1), target[octetCount - 1]);
+            }
+            readId++;
+        }
+
+        ASSERT_EQ(1, nbsSpscStepsDiscardCount(&steps, 1));
+        readId++;
+    }
+}
+
+#if !defined _WIN32
+#define TEST_SPSC_THREADED_STEP_COUNT (100000)
+
+typedef struct TestSpscProducer {
+    NbsSpscSteps* steps;
+    StepId startId;
+} TestSpscProducer;
+
+static void* testSpscProduce(void* userData)
+{
+    TestSpscProducer* producer = (TestSpscProducer*) userData;
+    uint8_t payload[32];
+    StepId writeId = producer->startId;
+    for (size_t i = 0; i < TEST_SPSC_THREADED_STEP_COUNT; ++i) {
+        size_t octetCount = 1 + (writeId % sizeof(payload));
+        tc_memset_octets(payload, (uint8_t) writeId, octetCount);
+        while (nbsSpscStepsWrite(producer->steps, writeId, payload, octetCount) == NimbleStepErrBufferFull) {
+            sched_yield();
+        }
+        writeId++;
+    }
+
+    return 0;
+}
+
+UTEST(NimbleSteps, spscProducerAndConsumerThreads)
+{
+    static NbsSpscSteps steps;
+    ImprintLinearAllocator allocator;
+    Clog log;
+
+    log.config = &g_clog;
+    log.constantPrefix = "spscThreads";
+
+    imprintLinearAllocatorInit(&allocator, testStepsMemory, sizeof(testStepsMemory), "spscThreads");
+    ASSERT_EQ(0, nbsSpscStepsInit(&steps, &allocator.info, 32, 16, log));
+    StepId startId = 77;
+    nbsSpscStepsReInit(&steps, startId);
+
+    TestSpscProducer producer;
+    producer.steps = &steps;
+    producer.startId = startId;
+    pthread_t producerThread;
+    ASSERT_EQ(0, pthread_create(&producerThread, 0, testSpscProduce, &producer));
+
+    // Any torn or reordered step shows up as a wrong id, length or payload
+    size_t errorCount = 0;
+    StepId expectedId = startId;
+    for (size_t i = 0; i < TEST_SPSC_THREADED_STEP_COUNT; ++i) {
+        uint8_t target[32];
+        StepId stepId;
+        int octetCount;
+        while ((octetCount = nbsSpscStepsRead(&steps, &stepId, target, sizeof(target))) ==
+               NimbleStepErrCollectionIsEmpty) {
+            sched_yield();
+        }
+        if (stepId != expectedId || octetCount != (int) (1 + (expectedId % sizeof(target)))) {
+            errorCount++;
+        } else {
+            for (int j = 0; j < octetCount; ++j) {
+                if (target[j] != (uint8_t) expectedId) {
+                    errorCount++;
+                    break;
+                }
+            }
+        }
+        expectedId++;
+    }
+
+    ASSERT_EQ(0, pthread_join(producerThread, 0));
+    ASSERT_EQ(0, errorCount);
+    ASSERT_EQ(0, nbsSpscStepsCount(&steps));
+}
+#endif
+
+UTEST(NimbleSteps, pendingStepsOutOfOrder)
+{
+    Clog log;
+
+    log.config = &g_clog;
+    log.constantPrefix = "pendingStepsOutOfOrder";
+
+    static uint8_t pendingMemory[16 * 1024];
+    ImprintLinearAllocator pendingAllocator;
+    imprintLinearAllocatorInit(&pendingAllocator, pendingMemory, sizeof(pendingMemory), "pendingSteps");
+
+    NbsPendingSteps pendingSteps;
+    StepId startId = 200;
+    nbsPendingStepsInit(&pendingSteps, startId, &pendingAllocator.info, 32, log);
+
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "pendingStepsOutOfOrder");
+
+    uint8_t payload[8];
+    static const StepId receiveOrder[] = {2, 0, 4, 3, 1};
+
+    payload[0] = (uint8_t) (startId + 2);
+    ASSERT_EQ(1, nbsPendingStepsTrySet(&pendingSteps, startId + 2, payload, sizeof(payload)));
+    ASSERT_FALSE(nbsPendingStepsCanBeAdvanced(&pendingSteps));
+    ASSERT_EQ(0, nbsPendingStepsCopy(&pendingSteps, &steps));
+
+    for (size_t i = 1; i < sizeof(receiveOrder) / sizeof(receiveOrder[0]); ++i) {
+        StepId stepId = startId + receiveOrder[i];
+        payload[0] = (uint8_t) stepId;
+        ASSERT_EQ(1, nbsPendingStepsTrySet(&pendingSteps, stepId, payload, sizeof(payload)));
+    }
+
+    ASSERT_EQ(0, nbsPendingStepsTrySet(&pendingSteps, startId + 3, payload, sizeof(payload)));
+    ASSERT_EQ(NimbleStepErrTooFarAhead, nbsPendingStepsTrySet(&pendingSteps, startId + NBS_PENDING_STEPS_WINDOW_SIZE,
+                                                               payload, sizeof(payload)));
+
+    StepId headId;
+    NimbleStepsReceiveMaskBits mask = nbsPendingStepsReceiveMask(&pendingSteps, &headId);
+    ASSERT_EQ(startId + 5, headId);
+    ASSERT_EQ(NimbleStepsReceiveMaskAllReceived, mask);
+
+    ASSERT_EQ(5, nbsPendingStepsCopy(&pendingSteps, &steps));
+    ASSERT_EQ(5, nbsStepsCount(&steps));
+
+    for (StepId i = 0; i < 5; ++i) {
+        StepId readId;
+        uint8_t target[8];
+        ASSERT_EQ((int) sizeof(target), nbsStepsRead(&steps, &readId, target, sizeof(target)));
+        ASSERT_EQ(startId + i, readId);
+        ASSERT_EQ((uint8_t) readId, target[0]);
+    }
+}
+
+UTEST(NimbleSteps, pendingStepsCopyKeepsStepsThatDoNotFit)
+{
+    Clog log;
+
+    log.config = &g_clog;
+    log.constantPrefix = "pendingStepsCopyFull";
+
+    static uint8_t pendingMemory[16 * 1024];
+    ImprintLinearAllocator pendingAllocator;
+    imprintLinearAllocatorInit(&pendingAllocator, pendingMemory, sizeof(pendingMemory), "pendingSteps");
+
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+    StepId startId = 700;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "pendingStepsCopyFull");
+
+    uint8_t payload[8];
+    tc_memset_octets(payload, 0x33, sizeof(payload));
+    size_t capacity = steps.windowSize / 2;
+    StepId writeId = startId;
+    for (size_t i = 0; i < capacity - 2; ++i) {
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId++, payload, sizeof(payload)));
+    }
+
+    NbsPendingSteps pendingSteps;
+    nbsPendingStepsInit(&pendingSteps, writeId, &pendingAllocator.info, 32, log);
+    for (StepId i = 0; i < 4; ++i) {
+        payload[0] = (uint8_t) (writeId + i);
+        ASSERT_EQ(1, nbsPendingStepsTrySet(&pendingSteps, writeId + i, payload, sizeof(payload)));
+    }
+
+    ASSERT_EQ(2, nbsPendingStepsCopy(&pendingSteps, &steps));
+    ASSERT_EQ(2, pendingSteps.storedCount);
+    ASSERT_TRUE(nbsPendingStepsCanBeAdvanced(&pendingSteps));
+
+    // Retained steps still take up room, so nothing more is copied until they are released
+    NbsStepsSnapshot snapshot;
+    nbsStepsSnapshot(&steps, &snapshot);
+    ASSERT_EQ(0, nbsStepsRetain(&steps, &snapshot));
+    ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 2));
+    ASSERT_EQ(0, nbsPendingStepsCopy(&pendingSteps, &steps));
+    ASSERT_EQ(2, pendingSteps.storedCount);
+
+    nbsStepsReleaseRetained(&steps);
+    ASSERT_EQ(2, nbsPendingStepsCopy(&pendingSteps, &steps));
+    ASSERT_EQ(0, pendingSteps.storedCount);
+    ASSERT_EQ(capacity, nbsStepsCount(&steps));
+
+    StepId lastId;
+    ASSERT_TRUE(nbsStepsLatestStepId(&steps, &lastId));
+    ASSERT_EQ(writeId + 3, lastId);
+}
+
+UTEST(NimbleSteps, wideReceiveMaskRanges)
+{
+    NimbleStepsReceiveMaskWide receiveMask;
+
+    StepId startId = 1000;
+    nimbleStepsReceiveMaskWideInit(&receiveMask, startId, 256);
+
+    ASSERT_EQ(0, nimbleStepsReceiveMaskWideReceivedStep(&receiveMask, startId + 199));
+    ASSERT_EQ(0, nimbleStepsReceiveMaskWideReceivedStep(&receiveMask, startId + 70));
+    ASSERT_EQ(0, nimbleStepsReceiveMaskWideReceivedStep(&receiveMask, startId + 71));
+    ASSERT_EQ(NimbleStepErrTooFarAhead, nimbleStepsReceiveMaskWideReceivedStep(&receiveMask, startId + 200 + 256));
+
+    ASSERT_EQ(startId + 200, receiveMask.expectingWriteId);
+    ASSERT_EQ(197, nimbleStepsReceiveMaskWideMissingCount(&receiveMask));
+    ASSERT_TRUE(nimbleStepsReceiveMaskWideIsReceived(&receiveMask, startId - 1));
+    ASSERT_FALSE(nimbleStepsReceiveMaskWideIsReceived(&receiveMask, startId + 69));
+
+    NbsPendingRange ranges[4];
+    int rangeCount = nbsPendingStepsRangesWide(&receiveMask, startId + 300, ranges, 4, 1000);
+    ASSERT_EQ(2, rangeCount);
+    ASSERT_EQ(startId, ranges[0].startId);
+    ASSERT_EQ(70, ranges[0].count);
+    ASSERT_EQ(startId + 72, ranges[1].startId);
+    ASSERT_EQ(127, ranges[1].count);
+
+    rangeCount = nbsPendingStepsRangesWide(&receiveMask, startId + 300, ranges, 4, 100);
+    ASSERT_EQ(2, rangeCount);
+    ASSERT_EQ(30, ranges[1].count);
+}
+
+UTEST(NimbleSteps, pendingStepsWideWindow)
+{
+    Clog log;
+
+    log.config = &g_clog;
+    log.constantPrefix = "pendingStepsWideWindow";
+
+    static uint8_t pendingMemory[32 * 1024];
+    ImprintLinearAllocator pendingAllocator;
+    imprintLinearAllocatorInit(&pendingAllocator, pendingMemory, sizeof(pendingMemory), "pendingSteps");
+
+    NbsPendingSteps pendingSteps;
+    StepId startId = 10;
+    nbsPendingStepsInitWithWindowSize(&pendingSteps, startId, &pendingAllocator.info, 16, 256, log);
+
+    uint8_t payload[4] = {1, 2, 3, 4};
+    ASSERT_EQ(1, nbsPendingStepsTrySet(&pendingSteps, startId + 200, payload, sizeof(payload)));
+    ASSERT_LT(nbsPendingStepsTrySet(&pendingSteps, startId + 256, payload, sizeof(payload)), 0);
+    ASSERT_EQ(1, nbsPendingStepsTrySet(&pendingSteps, startId, payload, sizeof(payload)));
+
+    NbsPendingRange ranges[2];
+    int rangeCount = nbsPendingStepsRangesWide(nbsPendingStepsReceiveMaskWide(&pendingSteps), startId + 200, ranges,
+                                               2, 256);
+    ASSERT_EQ(1, rangeCount);
+    ASSERT_EQ(startId + 1, ranges[0].startId);
+    ASSERT_EQ(199, ranges[0].count);
+}
+
+UTEST(NimbleSteps, stepInfoIsCompact)
+{
+    ASSERT_EQ(8, sizeof(StepInfo));
+}
+
+UTEST(NimbleSteps, composeCombinedStepInPlace)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 300;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "composeCombinedStep");
+
+    uint8_t input[20];
+    uint8_t readPayload[64];
+    StepId writeId = startId;
+    StepId expectedReadId = startId;
+
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t inputOctetCount = 1 + (i % sizeof(input));
+        for (size_t j = 0; j < inputOctetCount; ++j) {
+            input[j] = (uint8_t) (writeId + j);
+        }
+
+        if (i % 3 == 0) {
+            // Plain writes in between move the write position, so composed steps end up at every offset
+            ASSERT_EQ((int) inputOctetCount, nbsStepsWrite(&steps, writeId, input, inputOctetCount));
+        } else {
+            NbsCombinedStepComposer composer;
+            ASSERT_EQ(0, nbsCombinedStepComposerBegin(&composer, &steps, writeId));
+            ASSERT_EQ(0, nbsCombinedStepComposerAdd(&composer, 2, input, inputOctetCount));
+            ASSERT_LT(nbsCombinedStepComposerAdd(&composer, 2, input, inputOctetCount), 0);
+            ASSERT_EQ(0, nbsCombinedStepComposerAdd(&composer, 7, input, 1));
+            int octetCount = nbsCombinedStepComposerCommit(&composer);
+            ASSERT_EQ((int) (1 + 2 + inputOctetCount + 2 + 1), octetCount);
+
+            NbsStepView view;
+            ASSERT_EQ(octetCount, nbsStepsViewAtIndex(&steps, nbsStepsGetIndexForStep(&steps, writeId), &view));
+            ASSERT_EQ(0, view.second.octetCount);
+            ASSERT_EQ(2, view.first.payload[0]);
+            ASSERT_EQ(2, view.first.payload[1]);
+            ASSERT_EQ(inputOctetCount, view.first.payload[2]);
+            ASSERT_EQ(0, memcmp(view.first.payload + 3, input, inputOctetCount));
+            ASSERT_EQ(7, view.first.payload[3 + inputOctetCount]);
+        }
+        writeId++;
+
+        while (nbsStepsCount(&steps) > 8) {
+            StepId readId;
+            if (expectedReadId % 2) {
+                ASSERT_GT(nbsStepsRead(&steps, &readId, readPayload, sizeof(readPayload)), 0);
+                if (expectedReadId % 3 == startId % 3) {
+                    ASSERT_EQ((uint8_t) readId, readPayload[0]);
+                } else {
+                    ASSERT_EQ((uint8_t) readId, readPayload[3]);
+                }
+            } else {
+                ASSERT_EQ(0, nbsStepsDiscard(&steps, &readId));
+            }
+            ASSERT_EQ(expectedReadId, readId);
+            expectedReadId++;
+        }
+    }
+
+    NbsCombinedStepComposer canceled;
+    ASSERT_EQ(0, nbsCombinedStepComposerBegin(&canceled, &steps, writeId));
+    ASSERT_LT(nbsStepsWrite(&steps, writeId, input, 1), 0);
+    nbsCombinedStepComposerCancel(&canceled);
+    ASSERT_EQ(1, nbsStepsWrite(&steps, writeId, input, 1));
+}
+
+UTEST(NimbleSteps, reserveAndCommitWithStream)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 7000;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "reserveAndCommit");
+
+    StepId writeId = startId;
+    uint8_t readPayload[64];
+
+    for (size_t i = 0; i < 1000; ++i) {
+        FldOutStream outStream;
+        ASSERT_EQ(0, nbsStepsWriteReserveStream(&steps, writeId, 64, &outStream));
+        ASSERT_LT(nbsStepsWriteReserveStream(&steps, writeId, 64, &outStream), 0);
+        fldOutStreamWriteUInt32(&outStream, writeId);
+        for (size_t j = 0; j < i % 40; ++j) {
+            fldOutStreamWriteUInt8(&outStream, (uint8_t) j);
+        }
+        ASSERT_EQ((int) (4 + i % 40), nbsStepsWriteCommitStream(&steps, &outStream));
+        writeId++;
+
+        if (nbsStepsCount(&steps) > 30) {
+            StepId readId;
+            int octetCount = nbsStepsRead(&steps, &readId, readPayload, sizeof(readPayload));
+            ASSERT_GE(octetCount, 4);
+
+            FldInStream inStream;
+            fldInStreamInit(&inStream, readPayload, (size_t) octetCount);
+            uint32_t serializedId;
+            fldInStreamReadUInt32(&inStream, &serializedId);
+            ASSERT_EQ(readId, serializedId);
+        }
+    }
+
+    uint8_t* payload;
+    ASSERT_EQ(0, nbsStepsWriteReserve(&steps, writeId, 16, &payload));
+    ASSERT_LT(nbsStepsWriteCommit(&steps, 17), 0);
+    nbsStepsWriteCancel(&steps);
+    ASSERT_LT(nbsStepsWriteCommit(&steps, 16), 0);
+    ASSERT_LT(nbsStepsWriteReserve(&steps, writeId + 1, 16, &payload), 0);
+}
+
+UTEST(NimbleSteps, arenaRecyclesStepsBuffers)
+{
+    static uint8_t slotTableMemory[32 * 1024];
+    ImprintLinearAllocator allocator;
+    imprintLinearAllocatorInit(&allocator, slotTableMemory, sizeof(slotTableMemory), "arena");
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "arena";
+
+    size_t windowSize = 16;
+    size_t slotOctetCount = nbsStepsArenaSlotOctetCount(64, windowSize);
+    ASSERT_GE(slotOctetCount, nbsStepsFootprint(64, windowSize));
+    ASSERT_EQ(0, nbsStepsArenaSlabOctetCount(3, 64, windowSize) % NBS_STEPS_ARENA_HUGE_PAGE_SIZE);
+
+    NbsStepsArena arena;
+    ASSERT_EQ(0, nbsStepsArenaInit(&arena, &allocator.info, testStepsMemory, slotOctetCount * 3, 64, windowSize, log));
+    ASSERT_EQ(3, nbsStepsArenaFreeCount(&arena));
+
+    NbsSteps* first;
+    NbsSteps* second;
+    NbsSteps* third;
+    NbsSteps* tooMany;
+    ASSERT_EQ(0, nbsStepsArenaAcquire(&arena, 10, &first));
+    ASSERT_EQ(0, nbsStepsArenaAcquire(&arena, 20, &second));
+    ASSERT_EQ(0, nbsStepsArenaAcquire(&arena, 30, &third));
+    ASSERT_EQ(NimbleStepErrNoFreeSlot, nbsStepsArenaAcquire(&arena, 40, &tooMany));
+    ASSERT_EQ(3, nbsStepsArenaAcquiredCount(&arena));
+
+    uint8_t payload[64] = {0x42};
+    for (StepId id = 20; id < 28; ++id) {
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(second, id, payload, sizeof(payload)));
+    }
+    ASSERT_EQ(0, nbsStepsCount(first));
+    ASSERT_EQ(8, nbsStepsCount(second));
+
+    // The next owner must not get the stats, cursors or options of the previous one
+    NbsStepsStats stats;
+    nbsStepsSetStats(second, &stats);
+    ASSERT_GE(nbsStepsCursorAdd(second), 0);
+    nbsStepsSetRangeHashEnabled(second, true);
+    nbsStepsSetTargetDepth(second, 2);
+
+    ASSERT_EQ(0, nbsStepsArenaRelease(&arena, second));
+    ASSERT_EQ(NimbleStepErrNotInUse, nbsStepsArenaRelease(&arena, second));
+    ASSERT_EQ(2, nbsStepsArenaAcquiredCount(&arena));
+
+    NbsSteps* recycled;
+    ASSERT_EQ(0, nbsStepsArenaAcquire(&arena, 500, &recycled));
+    ASSERT_TRUE(recycled == second);
+    ASSERT_EQ(0, nbsStepsCount(recycled));
+    ASSERT_TRUE(recycled->stats == 0);
+    ASSERT_EQ(0, recycled->cursorMask);
+    ASSERT_FALSE(recycled->isRangeHashEnabled);
+    ASSERT_EQ(windowSize / 4, recycled->targetDepth);
+    ASSERT_EQ(1, nbsStepsWrite(recycled, 500, payload, 1));
+    ASSERT_EQ(0, stats.writeCount);
+}
+
+#if !defined _WIN32
+UTEST(NimbleSteps, stepLogRandomAccess)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 90;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "stepLog");
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "stepLog";
+
+    const char* basePath = "nimble_steps_test_step_log";
+    NbsStepLog stepLog;
+    ASSERT_EQ(0, nbsStepLogCreate(&stepLog, basePath, startId, 10, 64, log));
+    nbsStepsSetWriteListener(&steps, nbsStepLogWriteListener, &stepLog);
+
+    uint8_t payload[32];
+    for (StepId id = startId; id < startId + 25; ++id) {
+        size_t octetCount = 1 + id % sizeof(payload);
+        tc_memset_octets(payload, (uint8_t) id, octetCount);
+        nbsStepLogSetTime(&stepLog, (uint64_t) id * 16);
+        ASSERT_EQ((int) octetCount, nbsStepsWrite(&steps, id, payload, octetCount));
+        if (nbsStepsCount(&steps) > 4) {
+            ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 1));
+        }
+    }
+    ASSERT_EQ(0, nbsStepLogClose(&stepLog));
+
+    NbsStepLogReader reader;
+    ASSERT_EQ(0, nbsStepLogReaderOpen(&reader, basePath, log));
+    for (StepId id = startId + 24; id >= startId; --id) {
+        NbsStepLogRecord record;
+        ASSERT_EQ((int) (1 + id % sizeof(payload)), nbsStepLogReaderRead(&reader, id, &record));
+        ASSERT_EQ(id, record.stepId);
+        ASSERT_EQ((uint64_t) id * 16, record.time);
+        ASSERT_EQ((uint8_t) id, record.payload[record.octetCount - 1]);
+    }
+
+    NbsStepLogRecord missing;
+    ASSERT_LT(nbsStepLogReaderRead(&reader, startId + 25, &missing), 0);
+    ASSERT_LT(nbsStepLogReaderRead(&reader, startId - 1, &missing), 0);
+    nbsStepLogReaderClose(&reader);
+
+    // A payload that did not reach the disk is detected by the record checksum
+    FILE* lastSegment = fopen("nimble_steps_test_step_log.000002", "r+b");
+    ASSERT_TRUE(lastSegment != 0);
+    ASSERT_EQ(0, fseek(lastSegment, -1, SEEK_END));
+    int lastOctet = fgetc(lastSegment);
+    ASSERT_EQ(0, fseek(lastSegment, -1, SEEK_END));
+    ASSERT_NE(EOF, fputc(lastOctet ^ 0xff, lastSegment));
+    fclose(lastSegment);
+
+    ASSERT_EQ(0, nbsStepLogReaderOpen(&reader, basePath, log));
+    NbsStepLogRecord corrupt;
+    ASSERT_EQ(NimbleStepErrCorrupt, nbsStepLogReaderRead(&reader, startId + 24, &corrupt));
+    ASSERT_EQ((int) (1 + (startId + 23) % sizeof(payload)), nbsStepLogReaderRead(&reader, startId + 23, &corrupt));
+    nbsStepLogReaderClose(&reader);
+
+    remove("nimble_steps_test_step_log.000000");
+    remove("nimble_steps_test_step_log.000001");
+    remove("nimble_steps_test_step_log.000002");
+}
+#endif
+
+UTEST(NimbleSteps, deltaCodecRoundTrip)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 40;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "deltaCodec");
+
+    NbsStepCodec encoder;
+    NbsStepCodec decoder;
+    nbsStepCodecInit(&encoder);
+    nbsStepCodecInit(&decoder);
+
+    uint8_t step[48];
+    uint8_t decoded[48];
+    uint8_t written[8][48];
+    size_t writtenOctetCounts[8];
+    tc_memset_octets(step, 0x11, sizeof(step));
+    size_t encodedTotal = 0;
+    size_t rawTotal = 0;
+    StepId expectedReadId = startId;
+
+    for (StepId id = startId; id < startId + 600; ++id) {
+        // Mostly the same input, with an occasional change and size change
+        if (id % 17 == 0) {
+            step[id % sizeof(step)] ^= (uint8_t) id;
+        }
+        size_t octetCount = id % 50 == 0 ? 20 : sizeof(step);
+
+        int encodedOctetCount = nbsStepsWriteDelta(&steps, &encoder, id, step, octetCount);
+        ASSERT_GT(encodedOctetCount, 0);
+        encodedTotal += (size_t) encodedOctetCount;
+        rawTotal += octetCount;
+        tc_memcpy_octets(written[id % 8], step, octetCount);
+        writtenOctetCounts[id % 8] = octetCount;
+
+        while (nbsStepsCount(&steps) > 5) {
+            StepId readId;
+            int decodedOctetCount = nbsStepsReadDelta(&steps, &decoder, &readId, decoded, sizeof(decoded));
+            ASSERT_EQ(expectedReadId, readId);
+            ASSERT_EQ((int) writtenOctetCounts[readId % 8], decodedOctetCount);
+            ASSERT_EQ(0, memcmp(written[readId % 8], decoded, (size_t) decodedOctetCount));
+            expectedReadId++;
+        }
+    }
+
+    ASSERT_LT(encodedTotal * 4, rawTotal);
+
+    nbsStepCodecInit(&encoder);
+    nbsStepCodecInit(&decoder);
+    uint8_t encoded[sizeof(step) + NBS_STEP_CODEC_MAX_OVERHEAD_OCTET_COUNT];
+    for (size_t i = 0; i < sizeof(step); ++i) {
+        step[i] = (uint8_t) (i * 37);
+    }
+    int encodedOctetCount = nbsStepCodecEncode(&encoder, step, sizeof(step), encoded, sizeof(encoded));
+    ASSERT_GT(encodedOctetCount, 0);
+    ASSERT_EQ((int) sizeof(step), nbsStepCodecDecode(&decoder, encoded, (size_t) encodedOctetCount, decoded,
+                                                     sizeof(decoded)));
+    ASSERT_EQ(0, memcmp(step, decoded, sizeof(step)));
+    ASSERT_LT(nbsStepCodecDecode(&decoder, encoded, (size_t) encodedOctetCount - 1, decoded, sizeof(decoded)), 0);
+}
+
+UTEST(NimbleSteps, deltaCodecSkipsStepsAfterDiscard)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 90;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "deltaCodecDiscard");
+
+    NbsStepCodec encoder;
+    NbsStepCodec decoder;
+    nbsStepCodecInit(&encoder);
+    nbsStepCodecInit(&decoder);
+
+    uint8_t step[32];
+    for (StepId id = startId; id < startId + NBS_STEP_CODEC_KEYFRAME_INTERVAL + 4; ++id) {
+        tc_memset_octets(step, (uint8_t) id, sizeof(step));
+        ASSERT_GT(nbsStepsWriteDelta(&steps, &encoder, id, step, sizeof(step)), 0);
+    }
+
+    uint8_t decoded[32];
+    StepId readId;
+    ASSERT_EQ((int) sizeof(step), nbsStepsReadDelta(&steps, &decoder, &readId, decoded, sizeof(decoded)));
+    ASSERT_EQ((uint8_t) startId, decoded[0]);
+
+    // The decoder never saw the discarded step, so the delta steps after it can not be decoded
+    StepId discardedId;
+    ASSERT_EQ(0, nbsStepsDiscard(&steps, &discardedId));
+    ASSERT_EQ(startId + 1, discardedId);
+    StepId keyframeId = startId + NBS_STEP_CODEC_KEYFRAME_INTERVAL;
+    for (StepId id = startId + 2; id < keyframeId; ++id) {
+        ASSERT_EQ(NimbleStepErrMissingDeltaReference,
+                  nbsStepsReadDelta(&steps, &decoder, &readId, decoded, sizeof(decoded)));
+        ASSERT_EQ(id, readId);
+    }
+
+    // Decoding continues from the keyframe
+    for (StepId id = keyframeId; id < keyframeId + 4; ++id) {
+        ASSERT_EQ((int) sizeof(step), nbsStepsReadDelta(&steps, &decoder, &readId, decoded, sizeof(decoded)));
+        ASSERT_EQ(id, readId);
+        tc_memset_octets(step, (uint8_t) id, sizeof(step));
+        ASSERT_EQ(0, memcmp(step, decoded, sizeof(step)));
+    }
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+}
+
+UTEST(NimbleSteps, redundantStepsFromReceiveMask)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 100;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "redundantSteps");
+
+    uint8_t payload[10];
+    for (StepId id = startId; id < startId + 40; ++id) {
+        tc_memset_octets(payload, (uint8_t) id, sizeof(payload));
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, id, payload, sizeof(payload)));
+    }
+
+    // The peer has received everything before 130, except 110, 125 and 126
+    NimbleStepsReceiveMask receiveMask;
+    receiveMask.expectingWriteId = 130;
+    receiveMask.receiveMask = NimbleStepsReceiveMaskAllReceived & ~((1u << (129 - 110)) | (1u << (129 - 125)) |
+                                                                    (1u << (129 - 126)));
+
+    uint8_t datagram[1200];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, datagram, sizeof(datagram));
+    ASSERT_EQ(1 + 2 + 10, nbsRedundantStepsWrite(&steps, &receiveMask, &outStream, sizeof(datagram)));
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, datagram, outStream.pos);
+    uint8_t rangeCount;
+    fldInStreamReadUInt8(&inStream, &rangeCount);
+    ASSERT_EQ(3, rangeCount);
+
+    StepId expectedStartIds[3] = {110, 125, 130};
+    uint8_t expectedCounts[3] = {1, 2, 10};
+    for (size_t r = 0; r < rangeCount; ++r) {
+        uint32_t rangeStartId;
+        uint8_t stepCount;
+        fldInStreamReadUInt32(&inStream, &rangeStartId);
+        fldInStreamReadUInt8(&inStream, &stepCount);
+        ASSERT_EQ(expectedStartIds[r], rangeStartId);
+        ASSERT_EQ(expectedCounts[r], stepCount);
+        for (size_t i = 0; i < stepCount; ++i) {
+            uint16_t octetCount;
+            fldInStreamReadUInt16(&inStream, &octetCount);
+            ASSERT_EQ(sizeof(payload), octetCount);
+            fldInStreamReadOctets(&inStream, payload, octetCount);
+            ASSERT_EQ((uint8_t) (rangeStartId + i), payload[0]);
+        }
+    }
+    ASSERT_EQ(outStream.pos, inStream.pos);
+
+    // Only the oldest steps fit in a small budget
+    fldOutStreamInit(&outStream, datagram, sizeof(datagram));
+    ASSERT_EQ(3, nbsRedundantStepsWrite(&steps, &receiveMask, &outStream, 1 + 2 * (5 + 12) + 12));
+    ASSERT_EQ(1 + 2 * (5 + 12) + 12, outStream.pos);
+}
+
+UTEST(NimbleSteps, rangeHashMatchesBetweenBuffers)
+{
+    static uint8_t otherMemory[64 * 1024];
+    NbsSteps steps;
+    NbsSteps otherSteps;
+    ImprintLinearAllocator allocator;
+    ImprintLinearAllocator otherAllocator;
+
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), 10, "rangeHash");
+    testStepsInit(&otherSteps, &otherAllocator, otherMemory, sizeof(otherMemory), 50, "rangeHashOther");
+    nbsStepsSetRangeHashEnabled(&steps, true);
+
+    uint8_t payload[40];
+    for (StepId id = 10; id < 400; ++id) {
+        size_t octetCount = 1 + id % sizeof(payload);
+        tc_memset_octets(payload, (uint8_t) (id * 3), octetCount);
+        ASSERT_EQ((int) octetCount, nbsStepsWrite(&steps, id, payload, octetCount));
+        if (id >= 50) {
+            ASSERT_EQ((int) octetCount, nbsStepsWrite(&otherSteps, id, payload, octetCount));
+        }
+        if (id == 60) {
+            // Enabling later calculates the hashes for the steps already stored
+            nbsStepsSetRangeHashEnabled(&otherSteps, true);
+        }
+        if (nbsStepsCount(&steps) > 40) {
+            ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 1 + id % 3));
+        }
+        if (nbsStepsCount(&otherSteps) > 30) {
+            StepId discardedId;
+            ASSERT_EQ(0, nbsStepsDiscard(&otherSteps, &discardedId));
+        }
+    }
+
+    StepId firstCommonId = otherSteps.expectedReadId > steps.expectedReadId ? otherSteps.expectedReadId
+                                                                            : steps.expectedReadId;
+    uint64_t hash;
+    uint64_t otherHash;
+    ASSERT_EQ(0, nbsStepsRangeHash(&steps, firstCommonId, 399, &hash));
+    ASSERT_EQ(0, nbsStepsRangeHash(&otherSteps, firstCommonId, 399, &otherHash));
+    ASSERT_EQ(hash, otherHash);
+
+    ASSERT_EQ(0, nbsStepsRangeHash(&steps, 395, 398, &hash));
+    ASSERT_EQ(0, nbsStepsRangeHash(&otherSteps, 395, 398, &otherHash));
+    ASSERT_EQ(hash, otherHash);
+    ASSERT_EQ(0, nbsStepsRangeHash(&otherSteps, 395, 399, &otherHash));
+    ASSERT_NE(hash, otherHash);
+
+    ASSERT_LT(nbsStepsRangeHash(&steps, firstCommonId, 400, &hash), 0);
+    ASSERT_LT(nbsStepsRangeHash(&steps, steps.expectedReadId - 1, 399, &hash), 0);
+}
+
+UTEST(NimbleSteps, timeIndexedLookupAndArrivalStats)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 1;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "timeIndexed");
+
+    uint8_t payload[8] = {0};
+    uint64_t time = 1000;
+    for (StepId id = startId; id < startId + 300; ++id) {
+        // Every tenth step arrives late
+        time += id % 10 == 0 ? 48 : 16;
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWriteWithTime(&steps, id, time, payload, sizeof(payload)));
+        if (nbsStepsCount(&steps) > 100) {
+            ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 1));
+        }
+    }
+    ASSERT_LT(nbsStepsWriteWithTime(&steps, startId + 300, time - 1, payload, sizeof(payload)), 0);
+
+    StepId foundId;
+    uint64_t foundTime;
+    uint64_t previousTime;
+    ASSERT_EQ(0, nbsStepsTimeForStep(&steps, 250, &previousTime));
+    ASSERT_EQ(0, nbsStepsFindFirstAtOrAfterTime(&steps, previousTime + 1, &foundId));
+    ASSERT_EQ(251, foundId);
+    ASSERT_EQ(0, nbsStepsTimeForStep(&steps, foundId, &foundTime));
+    ASSERT_GT(foundTime, previousTime);
+
+    ASSERT_EQ(0, nbsStepsFindFirstAtOrAfterTime(&steps, 0, &foundId));
+    ASSERT_EQ(steps.expectedReadId, foundId);
+    ASSERT_LT(nbsStepsFindFirstAtOrAfterTime(&steps, time + 1, &foundId), 0);
+
+    NbsStepsArrivalSummary summary;
+    nbsStepsArrivalSummary(&steps, &summary);
+    ASSERT_EQ(299, summary.count);
+    ASSERT_EQ(16, summary.min);
+    ASSERT_EQ(48, summary.max);
+    ASSERT_EQ(19, summary.average);
+    ASSERT_GE(summary.percentile99, 48 * 3 / 4);
+    ASSERT_LE(summary.percentile99, 48);
+}
+
+UTEST(NimbleSteps, bufferingFollowsJitter)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 1;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "buffering");
+
+    NbsStepsBuffering buffering;
+    nbsStepsBufferingInit(&buffering, 16, 2, 20);
+
+    uint8_t payload[4] = {0};
+    uint64_t time = 0;
+    StepId writeId = startId;
+    NbsStepsBufferingAdvice advice;
+
+    // A steady link keeps the minimum depth
+    for (size_t tick = 0; tick < 200; ++tick) {
+        time += 16;
+        ASSERT_EQ(4, nbsStepsWriteWithTime(&steps, writeId++, time, payload, sizeof(payload)));
+        advice = nbsStepsBufferingUpdate(&buffering, &steps);
+        StepId readId;
+        nbsStepsRead(&steps, &readId, payload, sizeof(payload));
+    }
+    ASSERT_EQ(2, advice.targetDepth);
+    ASSERT_EQ(2, steps.targetDepth);
+    ASSERT_LT(nbsStepsBufferingJitter(&buffering), 4);
+
+    // Steps arriving in bursts raise the target depth
+    for (size_t tick = 0; tick < 200; ++tick) {
+        time += tick % 4 == 0 ? 40 : 8;
+        ASSERT_EQ(4, nbsStepsWriteWithTime(&steps, writeId++, time, payload, sizeof(payload)));
+        advice = nbsStepsBufferingUpdate(&buffering, &steps);
+        StepId readId;
+        nbsStepsRead(&steps, &readId, payload, sizeof(payload));
+    }
+    ASSERT_GT(advice.targetDepth, 2);
+    ASSERT_EQ(advice.targetDepth, steps.targetDepth);
+    ASSERT_EQ(NbsStepsBufferingActionSlowDown, advice.action);
+    ASSERT_LT(advice.tickRateAdjustmentPermille, 0);
+
+    // Too many buffered steps asks the consumer to catch up
+    for (size_t i = 0; i < advice.targetDepth + 4; ++i) {
+        time += 16;
+        ASSERT_EQ(4, nbsStepsWriteWithTime(&steps, writeId++, time, payload, sizeof(payload)));
+    }
+    advice = nbsStepsBufferingUpdate(&buffering, &steps);
+    ASSERT_EQ(NbsStepsBufferingActionCatchUp, advice.action);
+    ASSERT_GT(advice.tickRateAdjustmentPermille, 0);
+    ASSERT_FALSE(nbsStepsAllowedToAdd(&steps));
+}
+
+UTEST(NimbleSteps, snapshotRestoreReplaysRetainedSteps)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 500;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "snapshotRestore");
+
+    NbsStepsSnapshot confirmed;
+    nbsStepsSnapshot(&steps, &confirmed);
+    ASSERT_EQ(0, nbsStepsRetain(&steps, &confirmed));
+
+    uint8_t payload[60];
+    uint8_t target[64];
+    StepId writeId = startId;
+    StepId readId;
+    for (size_t tick = 0; tick < 600; ++tick) {
+        size_t octetCount = 1 + (writeId % sizeof(payload));
+        payload[0] = (uint8_t) writeId;
+        ASSERT_EQ((int) octetCount, nbsStepsWrite(&steps, writeId, payload, octetCount));
+        writeId++;
+
+        if (nbsStepsCount(&steps) > 8) {
+            ASSERT_EQ((int) (1 + (steps.expectedReadId % sizeof(payload))),
+                      nbsStepsRead(&steps, &readId, target, sizeof(target)));
+        }
+
+        if (tick % 10 == 9) {
+            // Roll back to the confirmed step and replay up to where reading was
+            StepId predictedReadId = steps.expectedReadId;
+            int rewindCount = nbsStepsRestore(&steps, &confirmed);
+            ASSERT_EQ((int) (predictedReadId - confirmed.readId), rewindCount);
+            for (StepId id = confirmed.readId; id != predictedReadId; ++id) {
+                ASSERT_EQ((int) (1 + (id % sizeof(payload))), nbsStepsRead(&steps, &readId, target, sizeof(target)));
+                ASSERT_EQ(id, readId);
+                ASSERT_EQ((uint8_t) id, target[0]);
+            }
+
+            nbsStepsSnapshot(&steps, &confirmed);
+            ASSERT_EQ(0, nbsStepsRetain(&steps, &confirmed));
+        }
+    }
+
+    // Retained steps use up room in the buffer
+    while (nbsStepsWrite(&steps, writeId, payload, 1) == 1) {
+        writeId++;
+    }
+    ASSERT_EQ(0, nbsStepsDiscardCount(&steps, nbsStepsCount(&steps)));
+    ASSERT_EQ(NimbleStepErrBufferFull, nbsStepsWrite(&steps, writeId, payload, 1));
+    ASSERT_EQ(NBS_WINDOW_SIZE / 2, (size_t) nbsStepsRestore(&steps, &confirmed));
+
+    NbsStepsSnapshot older = confirmed;
+    older.readId--;
+    ASSERT_EQ(NimbleStepErrNotRetained, nbsStepsRestore(&steps, &older));
+    ASSERT_EQ(NimbleStepErrNotRetained, nbsStepsRetain(&steps, &older));
+
+    ASSERT_EQ(0, nbsStepsDiscardCount(&steps, nbsStepsCount(&steps)));
+    nbsStepsReleaseRetained(&steps);
+    ASSERT_EQ(NimbleStepErrNotRetained, nbsStepsRestore(&steps, &confirmed));
+    ASSERT_EQ(1, nbsStepsWrite(&steps, writeId, payload, 1));
+}
+
+UTEST(NimbleSteps, cursorsReadIndependently)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 1200;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "cursors");
+
+    int simulation = nbsStepsCursorAdd(&steps);
+    int recorder = nbsStepsCursorAdd(&steps);
+    ASSERT_GE(simulation, 0);
+    ASSERT_GE(recorder, 0);
+    ASSERT_NE(simulation, recorder);
+
+    uint8_t payload[40];
+    StepId writeId = startId;
+    StepId recorderReadId = startId;
+    NbsStepView view;
+    for (size_t tick = 0; tick < 500; ++tick) {
+        payload[0] = (uint8_t) writeId;
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+        writeId++;
+
+        // The simulation keeps up, the recorder reads in bursts
+        ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, simulation, &view));
+        ASSERT_EQ(writeId - 1, view.stepId);
+        ASSERT_EQ(NimbleStepErrCollectionIsEmpty, nbsStepsCursorRead(&steps, simulation, &view));
+
+        if (tick % 50 == 49) {
+            while (nbsStepsCursorCount(&steps, recorder) > 0) {
+                ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, recorder, &view));
+                ASSERT_EQ(recorderReadId, view.stepId);
+                ASSERT_EQ((uint8_t) recorderReadId, view.first.payload[0]);
+                recorderReadId++;
+            }
+            // Every step has been passed by both cursors
+            ASSERT_EQ(0, nbsStepsCount(&steps));
+        } else {
+            ASSERT_EQ(tick % 50 + 1, nbsStepsCursorCount(&steps, recorder));
+        }
+    }
+
+    int extraCursors[NBS_STEPS_MAX_CURSOR_COUNT];
+    size_t extraCount = 0;
+    for (int cursor = nbsStepsCursorAdd(&steps); cursor >= 0; cursor = nbsStepsCursorAdd(&steps)) {
+        extraCursors[extraCount++] = cursor;
+    }
+    ASSERT_EQ(NBS_STEPS_MAX_CURSOR_COUNT - 2, extraCount);
+    ASSERT_EQ(NimbleStepErrNoFreeCursor, nbsStepsCursorAdd(&steps));
+
+    // Cursor indices that were never handed out are rejected
+    ASSERT_EQ(NimbleStepErrIndexOutOfRange, nbsStepsCursorRead(&steps, -1, &view));
+    ASSERT_EQ(NimbleStepErrIndexOutOfRange, nbsStepsCursorRead(&steps, NBS_STEPS_MAX_CURSOR_COUNT, &view));
+    ASSERT_EQ(0, nbsStepsCursorCount(&steps, 40));
+    nbsStepsCursorRemove(&steps, -3);
+    nbsStepsCursorRemove(&steps, 31);
+
+    // Removed cursors no longer hold back the discarding of steps
+    for (size_t i = 0; i < extraCount; ++i) {
+        nbsStepsCursorRemove(&steps, extraCursors[i]);
+    }
+    nbsStepsCursorRemove(&steps, recorder);
+    ASSERT_EQ(NimbleStepErrIndexOutOfRange, nbsStepsCursorRead(&steps, recorder, &view));
+    for (size_t i = 0; i < 4; ++i) {
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+        writeId++;
+        ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, simulation, &view));
+    }
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+}
+
+UTEST(NimbleSteps, cursorAddedLateStartsAfterReadSteps)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 1300;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "lateCursor");
+
+    int first = nbsStepsCursorAdd(&steps);
+    ASSERT_GE(first, 0);
+
+    uint8_t payload[40];
+    StepId writeId = startId;
+    for (size_t i = 0; i < 5; ++i) {
+        payload[0] = (uint8_t) writeId;
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+        writeId++;
+    }
+
+    NbsStepView view;
+    while (nbsStepsCursorCount(&steps, first) > 0) {
+        ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, first, &view));
+    }
+    ASSERT_EQ(writeId - 1, view.stepId);
+
+    // The drained buffer has no steps left, and the view of the last read step is still valid
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+    ASSERT_TRUE(nbsStepsAllowedToAdd(&steps));
+    ASSERT_EQ((uint8_t) (writeId - 1), view.first.payload[0]);
+
+    int late = nbsStepsCursorAdd(&steps);
+    ASSERT_GE(late, 0);
+    ASSERT_EQ(0, nbsStepsCursorCount(&steps, late));
+    ASSERT_EQ(NimbleStepErrCollectionIsEmpty, nbsStepsCursorRead(&steps, late, &view));
+
+    // A cursor added while another is part way through starts where that cursor is
+    for (size_t i = 0; i < 3; ++i) {
+        payload[0] = (uint8_t) writeId;
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+        writeId++;
+    }
+    ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, first, &view));
+    ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, first, &view));
+    nbsStepsCursorRemove(&steps, late);
+    late = nbsStepsCursorAdd(&steps);
+    ASSERT_EQ(1, nbsStepsCursorCount(&steps, late));
+    ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, late, &view));
+    ASSERT_EQ(writeId - 1, view.stepId);
+    ASSERT_EQ((int) sizeof(payload), nbsStepsCursorRead(&steps, first, &view));
+    ASSERT_EQ(0, nbsStepsCount(&steps));
+
+    // Every slot can be written again, since no phantom step is left in the count
+    while (nbsStepsHasRoomFor(&steps, 8)) {
+        ASSERT_EQ(8, nbsStepsWrite(&steps, writeId, payload, 8));
+        writeId++;
+    }
+    ASSERT_EQ(NBS_WINDOW_SIZE / 2, nbsStepsCount(&steps));
+    ASSERT_EQ(NimbleStepErrBufferFull, nbsStepsWrite(&steps, writeId, payload, 8));
+}
+
+static size_t testFanOutFlatten(const NbsStepsFanOutDatagram* datagram, uint8_t* target)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < datagram->sliceCount; ++i) {
+        memcpy(target + pos, datagram->slices[i].octets, datagram->slices[i].octetCount);
+        pos += datagram->slices[i].octetCount;
+    }
+    return pos;
+}
+
+UTEST(NimbleSteps, fanOutMatchesRedundantSteps)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 3000;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "fanOut");
+
+    static uint8_t fanOutMemory[32 * 1024];
+    ImprintLinearAllocator fanOutAllocator;
+    imprintLinearAllocatorInit(&fanOutAllocator, fanOutMemory, sizeof(fanOutMemory), "fanOut");
+    NbsStepsFanOut fanOut;
+    nbsStepsFanOutInit(&fanOut, &fanOutAllocator.info, &steps, 3, steps.log);
+
+    uint8_t payload[60];
+    StepId writeId = startId;
+    size_t maxOctetCounts[3] = {1200, 1200, 100};
+    for (size_t tick = 0; tick < 600; ++tick) {
+        size_t octetCount = 1 + (writeId * 7 % sizeof(payload));
+        for (size_t i = 0; i < octetCount; ++i) {
+            payload[i] = (uint8_t) (writeId + i);
+        }
+        ASSERT_EQ((int) octetCount, nbsStepsWrite(&steps, writeId, payload, octetCount));
+        writeId++;
+        if (nbsStepsCount(&steps) > 100) {
+            ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 1));
+        }
+        ASSERT_EQ(1, nbsStepsFanOutUpdate(&fanOut));
+
+        NimbleStepsReceiveMask receiveMasks[3];
+        receiveMasks[0].expectingWriteId = writeId - 5;
+        receiveMasks[0].receiveMask = NimbleStepsReceiveMaskAllReceived;
+        receiveMasks[1].expectingWriteId = writeId - 2;
+        receiveMasks[1].receiveMask = NimbleStepsReceiveMaskAllReceived & ~(uint64_t) 0x1052;
+        receiveMasks[2].expectingWriteId = steps.expectedReadId + 3;
+        receiveMasks[2].receiveMask = NimbleStepsReceiveMaskAllReceived & ~(uint64_t) 0x3;
+
+        for (size_t subscriber = 0; subscriber < 3; ++subscriber) {
+            nbsStepsFanOutAck(&fanOut, subscriber, &receiveMasks[subscriber]);
+
+            NbsStepsFanOutDatagram datagram;
+            int fanOutStepCount = nbsStepsFanOutDatagram(&fanOut, subscriber, maxOctetCounts[subscriber], &datagram);
+            uint8_t fanOutOctets[1200];
+            ASSERT_EQ(datagram.octetCount, testFanOutFlatten(&datagram, fanOutOctets));
+
+            uint8_t redundantOctets[1200];
+            FldOutStream stream;
+            fldOutStreamInit(&stream, redundantOctets, sizeof(redundantOctets));
+            int redundantStepCount = nbsRedundantStepsWrite(&steps, &receiveMasks[subscriber], &stream,
+                                                            maxOctetCounts[subscriber]);
+
+            ASSERT_EQ(redundantStepCount, fanOutStepCount);
+            ASSERT_EQ(stream.pos, datagram.octetCount);
+            ASSERT_EQ(0, memcmp(redundantOctets, fanOutOctets, stream.pos));
+        }
+    }
+
+    ASSERT_GT(fanOut.wrapEndOffset, 0);
+}
+
+UTEST(NimbleSteps, fanOutIgnoresOlderAck)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 3100;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "fanOutAck");
+
+    static uint8_t fanOutMemory[32 * 1024];
+    ImprintLinearAllocator fanOutAllocator;
+    imprintLinearAllocatorInit(&fanOutAllocator, fanOutMemory, sizeof(fanOutMemory), "fanOutAck");
+    NbsStepsFanOut fanOut;
+    nbsStepsFanOutInit(&fanOut, &fanOutAllocator.info, &steps, 1, steps.log);
+    nbsStepsFanOutResetSubscriber(&fanOut, 0, startId);
+
+    uint8_t payload[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    StepId writeId = startId;
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId, payload, sizeof(payload)));
+        writeId++;
+    }
+    ASSERT_EQ(10, nbsStepsFanOutUpdate(&fanOut));
+
+    // The older ack arrives after the newer one
+    NimbleStepsReceiveMask newerAck;
+    newerAck.expectingWriteId = startId + 8;
+    newerAck.receiveMask = NimbleStepsReceiveMaskAllReceived;
+    NimbleStepsReceiveMask olderAck;
+    olderAck.expectingWriteId = startId + 2;
+    olderAck.receiveMask = NimbleStepsReceiveMaskAllReceived;
+
+    NbsStepsFanOutDatagram datagram;
+    nbsStepsFanOutAck(&fanOut, 0, &newerAck);
+    ASSERT_EQ(2, nbsStepsFanOutDatagram(&fanOut, 0, 1200, &datagram));
+
+    nbsStepsFanOutAck(&fanOut, 0, &olderAck);
+    ASSERT_EQ(newerAck.expectingWriteId, fanOut.subscribers.expectingWriteIds[0]);
+    ASSERT_EQ(2, nbsStepsFanOutDatagram(&fanOut, 0, 1200, &datagram));
+
+    // Acks are ordered by distance, so an ack that passes the StepId wraparound is newer
+    nbsStepsFanOutResetSubscriber(&fanOut, 0, 0xfffffffe);
+    newerAck.expectingWriteId = 2;
+    nbsStepsFanOutAck(&fanOut, 0, &newerAck);
+    ASSERT_EQ(2, fanOut.subscribers.expectingWriteIds[0]);
+    olderAck.expectingWriteId = 0xfffffffd;
+    nbsStepsFanOutAck(&fanOut, 0, &olderAck);
+    ASSERT_EQ(2, fanOut.subscribers.expectingWriteIds[0]);
+}
+
+static bool testReceiveMaskIsReceived(const NimbleStepsReceiveMask* receiveMask, StepId stepId)
+{
+    if (stepId >= receiveMask->expectingWriteId) {
+        return false;
+    }
+    StepId bitIndex = receiveMask->expectingWriteId - 1 - stepId;
+    return bitIndex >= 64 || ((receiveMask->receiveMask >> bitIndex) & 1);
+}
+
+UTEST(NimbleSteps, receiveMaskTableMatchesSingleMasks)
+{
+    enum { connectionCount = 37 };
+    static uint8_t tableMemory[4 * 1024];
+    ImprintLinearAllocator allocator;
+    imprintLinearAllocatorInit(&allocator, tableMemory, sizeof(tableMemory), "receiveMaskTable");
+
+    StepId startId = 4000;
+    NimbleStepsReceiveMaskTable table;
+    nimbleStepsReceiveMaskTableInit(&table, &allocator.info, connectionCount, startId);
+
+    NimbleStepsReceiveMask singleMasks[connectionCount];
+    for (size_t i = 0; i < connectionCount; ++i) {
+        nimbleStepsReceiveMaskInit(&singleMasks[i], startId);
+    }
+
+    uint32_t random = 1;
+    NimbleStepsReceiveMaskArrival arrivals[64];
+    StepId headId = startId;
+    for (size_t batch = 0; batch < 50; ++batch) {
+        size_t expectedRejectedCount = 0;
+        for (size_t i = 0; i < 64; ++i) {
+            random = random * 1103515245u + 12345u;
+            NimbleStepsReceiveMaskArrival* arrival = &arrivals[i];
+            arrival->connectionIndex = (random >> 8) % connectionCount;
+            // Mostly recent steps, some late and some far away
+            arrival->stepId = headId + 2 - (StepId) ((random >> 16) % (batch % 5 == 4 ? 140 : 20));
+            if (nimbleStepsReceiveMaskReceivedStep(&singleMasks[arrival->connectionIndex], arrival->stepId) < 0) {
+                expectedRejectedCount++;
+            }
+        }
+        ASSERT_EQ(expectedRejectedCount, nimbleStepsReceiveMaskTableReceivedSteps(&table, arrivals, 64));
+        headId += 3;
+
+        // Also align to heads older than the expected steps, up to further back than the mask covers
+        StepId ackHeadId = headId - (StepId) (batch % 4) * 25;
+        NimbleStepsReceiveMaskBits ackMasks[connectionCount];
+        nimbleStepsReceiveMaskTableAckMasks(&table, ackHeadId, ackMasks);
+        for (size_t c = 0; c < connectionCount; ++c) {
+            NimbleStepsReceiveMask fromTable;
+            nimbleStepsReceiveMaskTableGet(&table, c, &fromTable);
+            ASSERT_EQ(singleMasks[c].expectingWriteId, fromTable.expectingWriteId);
+            ASSERT_EQ(singleMasks[c].receiveMask, fromTable.receiveMask);
+
+            for (StepId bit = 0; bit < 64; ++bit) {
+                bool isReceived = (ackMasks[c] >> bit) & 1;
+                ASSERT_EQ(testReceiveMaskIsReceived(&singleMasks[c], ackHeadId - 1 - bit), isReceived);
+            }
+        }
+    }
+}
+
+UTEST(NimbleSteps, statsCountHotPathEvents)
+{
+    NbsSteps steps;
+    ImprintLinearAllocator allocator;
+
+    StepId startId = 300;
+    testStepsInit(&steps, &allocator, testStepsMemory, sizeof(testStepsMemory), startId, "stats");
+
+    NbsStepsStats stats;
+    nbsStepsSetStats(&steps, &stats);
+
+    uint8_t payload[40];
+    tc_memset_octets(payload, 0x22, sizeof(payload));
+    StepId writeId = startId;
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, writeId++, payload, sizeof(payload)));
+    }
+    nbsStepsStatsSampleDepth(&steps);
+
+    // A step that was already written is late, a step ahead of the expected one is out of order. Neither is dropped,
+    // the buffer is unchanged and still accepts the expected step.
+    ASSERT_EQ(NimbleStepErrWrongStepId, nbsStepsWrite(&steps, startId, payload, sizeof(payload)));
+    for (StepId ahead = 3; ahead < 6; ++ahead) {
+        ASSERT_EQ(NimbleStepErrWrongStepId, nbsStepsWrite(&steps, writeId + ahead, payload, sizeof(payload)));
+    }
+
+    StepId readId;
+    uint8_t target[64];
+    ASSERT_EQ((int) sizeof(payload), nbsStepsRead(&steps, &readId, target, sizeof(target)));
+    ASSERT_EQ((int) sizeof(payload), nbsStepsRead(&steps, &readId, target, sizeof(target)));
+    ASSERT_EQ(0, nbsStepsDiscardCount(&steps, 3));
+    nbsStepsStatsSampleDepth(&steps);
+
+    size_t octetCounts[2] = {8, 32};
+    ASSERT_EQ(2, nbsStepsWriteBatch(&steps, writeId, payload, octetCounts, 2));
+    writeId += 2;
+
+    NbsStepsStats copy;
+    nbsStepsStatsRead(&stats, &copy);
+    ASSERT_EQ(12, copy.writeCount);
+    ASSERT_EQ(2, copy.readCount);
+    ASSERT_EQ(3, copy.discardCount);
+    ASSERT_EQ(0, copy.droppedCount);
+    ASSERT_EQ(1, copy.lateCount);
+    ASSERT_EQ(3, copy.outOfOrderCount);
+    ASSERT_EQ(10, copy.peakStepCount);
+    ASSERT_EQ(1, copy.depthHistogram[10]);
+    ASSERT_EQ(1, copy.depthHistogram[5]);
+    ASSERT_EQ(1, copy.octetCountHistogram[4]);
+    ASSERT_EQ(11, copy.octetCountHistogram[6]);
+
+    // Steps rejected by a full buffer are dropped, and deep buffers share the last depth bucket
+    while (nbsStepsWrite(&steps, writeId, payload, sizeof(payload)) >= 0) {
+        writeId++;
+    }
+    nbsStepsStatsSampleDepth(&steps);
+    nbsStepsStatsRead(&stats, &copy);
+    ASSERT_EQ(1, copy.droppedCount);
+    ASSERT_EQ(nbsStepsCount(&steps), copy.peakStepCount);
+    ASSERT_EQ(1, copy.depthHistogram[NBS_STEPS_STATS_DEPTH_BUCKET_COUNT - 1]);
+
+    // Late and out of order are told apart across a StepId wraparound
+    nbsStepsReInit(&steps, 0xFFFFFFFE);
+    ASSERT_EQ(NimbleStepErrWrongStepId, nbsStepsWrite(&steps, 1, payload, sizeof(payload)));
+    ASSERT_EQ(NimbleStepErrWrongStepId, nbsStepsWrite(&steps, 0xFFFFFFF0, payload, sizeof(payload)));
+    nbsStepsStatsRead(&stats, &copy);
+    ASSERT_EQ(2, copy.lateCount);
+    ASSERT_EQ(4, copy.outOfOrderCount);
+
+    // Nothing is counted when the stats are removed
+    nbsStepsSetStats(&steps, 0);
+    ASSERT_EQ((int) sizeof(payload), nbsStepsWrite(&steps, 0xFFFFFFFE, payload, sizeof(payload)));
+    ASSERT_EQ((int) sizeof(payload), nbsStepsRead(&steps, &readId, target, sizeof(target)));
+    ASSERT_EQ(copy.writeCount, stats.writeCount);
+    ASSERT_EQ(copy.readCount, stats.readCount);
+}